@@ -0,0 +1,152 @@
+#include <WProgram.h>
+#include "AnalogWatch.h"
+
+
+AnalogWatch::AnalogWatch(int (*read)(int channel))
+	: read(read)
+	, used(0)
+	, unsampled(0)
+	, above(0)
+	, on_cross(NULL)
+	, on_change(NULL)
+{
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		samples[i] = 0;
+		thresholds[i] = -1;
+		hysteresis[i] = 0;
+		deadbands[i] = 0;
+		min_intervals[i] = 0;
+		reported[i] = 0;
+		report_times[i] = 0;
+	}
+}
+
+
+void
+AnalogWatch::use(int channel)
+{
+	if (channel < 0 || channel >= NUM_CHANNELS || (used & (1 << channel)))
+		return;
+	
+	// The ADC may be busy (eg. capturing a waveform) so the first sample is
+	// left to the next refresh
+	used |= 1 << channel;
+	unsampled |= 1 << channel;
+}
+
+
+void
+AnalogWatch::set_threshold(int channel, int threshold)
+{
+	if (channel < 0 || channel >= NUM_CHANNELS)
+		return;
+	
+	thresholds[channel] = threshold;
+	use(channel);
+	
+	// Report the first crossing from wherever the channel is now (or will be
+	// when first sampled)
+	update_above(channel);
+}
+
+
+void
+AnalogWatch::update_above(int channel)
+{
+	if (samples[channel] > thresholds[channel])
+		above |= 1 << channel;
+	else
+		above &= ~(1 << channel);
+}
+
+
+void
+AnalogWatch::set_hysteresis(int channel, int hysteresis)
+{
+	if (channel >= 0 && channel < NUM_CHANNELS && hysteresis >= 0)
+		this->hysteresis[channel] = hysteresis;
+}
+
+
+void
+AnalogWatch::set_deadband(int channel, int deadband)
+{
+	if (channel < 0 || channel >= NUM_CHANNELS || deadband < 0)
+		return;
+	
+	deadbands[channel] = deadband;
+	reported[channel] = samples[channel];
+	
+	use(channel);
+}
+
+
+void
+AnalogWatch::set_interval(int channel, unsigned long min_interval)
+{
+	if (channel >= 0 && channel < NUM_CHANNELS)
+		min_intervals[channel] = min_interval;
+}
+
+
+void
+AnalogWatch::unwatch(int channel)
+{
+	if (channel < 0 || channel >= NUM_CHANNELS)
+		return;
+	
+	thresholds[channel] = -1;
+	deadbands[channel] = 0;
+}
+
+
+int
+AnalogWatch::get(int channel)
+{
+	return samples[channel];
+}
+
+
+void
+AnalogWatch::refresh(unsigned long now)
+{
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		if (!(used & (1 << i)))
+			continue;
+		
+		int value = read(i);
+		samples[i] = value;
+		
+		// Nothing to compare a first sample against
+		if (unsampled & (1 << i)) {
+			unsampled &= ~(1 << i);
+			update_above(i);
+			reported[i] = value;
+			continue;
+		}
+		
+		// Threshold crossings
+		if (thresholds[i] >= 0) {
+			bool was_above = above & (1 << i);
+			if (!was_above && value > thresholds[i] + hysteresis[i]) {
+				above |= 1 << i;
+				if (on_cross)
+					on_cross(i, true);
+			} else if (was_above && value < thresholds[i] - hysteresis[i]) {
+				above &= ~(1 << i);
+				if (on_cross)
+					on_cross(i, false);
+			}
+		}
+		
+		// Stream values which have moved far enough
+		if (deadbands[i] != 0
+		    && abs(value - reported[i]) >= deadbands[i]
+		    && now - report_times[i] >= min_intervals[i]) {
+			reported[i] = value;
+			report_times[i] = now;
+			if (on_change)
+				on_change(i, value);
+		}
+	}
+}
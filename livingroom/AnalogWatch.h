@@ -0,0 +1,72 @@
+#ifndef ANALOGWATCH_H
+#define ANALOGWATCH_H
+
+#include <WProgram.h>
+
+
+/* Samples a set of analog channels in one pass and reports meaningful changes
+ * on the ones being watched. A watched channel can report crossing a
+ * threshold (with hysteresis) and/or stream its value whenever it moves by
+ * more than a deadband, no more often than a minimum interval.
+ */
+class AnalogWatch {
+	public:
+		static const int NUM_CHANNELS = 6;
+		
+		// Samples are taken using the given function
+		AnalogWatch(int (*read)(int channel));
+		
+		// Sample a channel even when it isn't watched (for get()). The first
+		// sample is taken by the next refresh, the ADC is never read outside
+		// refresh().
+		void use(int channel);
+		
+		// Watch a channel for crossing a threshold, a negative threshold
+		// disables this
+		void set_threshold(int channel, int threshold);
+		void set_hysteresis(int channel, int hysteresis);
+		
+		// Watch a channel for moving by at least the deadband, reporting no
+		// more often than the interval (ms). A zero deadband disables this.
+		void set_deadband(int channel, int deadband);
+		void set_interval(int channel, unsigned long min_interval);
+		
+		// Stop all reports from a channel
+		void unwatch(int channel);
+		
+		// Sample all channels in use and raise callbacks for any changes
+		void refresh(unsigned long now);
+		
+		// Most recent sample of a channel
+		int get(int channel);
+	
+	private:
+		int (*read)(int channel);
+		
+		uint8_t used; // Bitmask of channels being sampled
+		uint8_t unsampled; // Bitmask of channels awaiting their first sample
+		
+		int samples[NUM_CHANNELS];
+		
+		// Threshold reporting
+		int     thresholds[NUM_CHANNELS];
+		int     hysteresis[NUM_CHANNELS];
+		uint8_t above; // Bitmask of channels above their threshold
+		
+		// Deadband streaming
+		int           deadbands[NUM_CHANNELS];
+		unsigned long min_intervals[NUM_CHANNELS];
+		int           reported[NUM_CHANNELS];
+		unsigned long report_times[NUM_CHANNELS];
+	
+	public:
+		void (*on_cross)(int channel, bool above);
+		void (*on_change)(int channel, int value);
+	
+	private:
+		// Whether a channel's sample is above its threshold
+		void update_above(int channel);
+};
+
+
+#endif
@@ -2,14 +2,15 @@
 #include "Buttons.h"
 
 
-ButtonManager::ButtonManager(const int long_press_duration,
-                             const int     num_modes,
-                             const int     num_btn_norm,
-                             const uint8_t btn_norm_masks[],
-                             const int     num_btn_mode,
-                             const uint8_t btn_mode_masks[],
-                             const int     num_btn_mod,
-                             const uint8_t btn_mod_masks[])
+template <typename State>
+ButtonManager<State>::ButtonManager(const int long_press_duration,
+                                    const int     num_modes,
+                                    const int     num_btn_norm,
+                                    const State   btn_norm_masks[],
+                                    const int     num_btn_mode,
+                                    const State   btn_mode_masks[],
+                                    const int     num_btn_mod,
+                                    const State   btn_mod_masks[])
 	: long_press_duration(long_press_duration)
 	, num_modes(num_modes)
 	, num_btn_norm(num_btn_norm)
@@ -18,6 +19,9 @@ ButtonManager::ButtonManager(const int long_press_duration,
 	, btn_mode_masks(btn_mode_masks)
 	, num_btn_mod(num_btn_mod)
 	, btn_mod_masks(btn_mod_masks)
+	, btn_norm_all(combine(num_btn_norm, btn_norm_masks))
+	, btn_mode_all(combine(num_btn_mode, btn_mode_masks))
+	, btn_mod_all(combine(num_btn_mod, btn_mod_masks))
 	, mode(1)
 	, cur_btn_states(0)
 	, cum_btn_states(0)
@@ -26,6 +30,7 @@ ButtonManager::ButtonManager(const int long_press_duration,
 	, hold_started(false)
 	, hold_start_time(0)
 	, event_fired(false)
+	, now(0)
 	, on_mode_change(NULL)
 	, on_press(NULL)
 	, on_hold_start(NULL)
@@ -35,9 +40,28 @@ ButtonManager::ButtonManager(const int long_press_duration,
 }
 
 
+template <typename State>
 void
-ButtonManager::set_btn_states(uint8_t new_btn_states)
+ButtonManager<State>::set_btn_states(State new_btn_states)
 {
+	set_btn_states(new_btn_states, millis());
+}
+
+
+template <typename State>
+void
+ButtonManager<State>::set_btn_states(State new_btn_states, const Tick &tick)
+{
+	set_btn_states(new_btn_states, tick.ms);
+}
+
+
+template <typename State>
+void
+ButtonManager<State>::set_btn_states(State new_btn_states, unsigned long now)
+{
+	this->now = now;
+	
 	// What buttons are newly pressed
 	add_btn_states = (~cur_btn_states) & new_btn_states;
 	
@@ -74,21 +98,70 @@ ButtonManager::set_btn_states(uint8_t new_btn_states)
 			// An event has been fired
 			event_fired = true;
 		}
-	} else {
-		// An event has been fired, can we start again yet?
-		if (cur_btn_states == 0) {
-			event_fired = false;
-			cum_btn_states = 0;
-			add_btn_states = 0;
-		}
 	}
+	
+	// An event has been fired, can we start again yet? This is checked in the
+	// same update so a press straight after a release isn't missed.
+	if (event_fired && cur_btn_states == 0) {
+		// Buttons pressed after the event may have restarted the timer
+		stop_hold_timer(false);
+		
+		event_fired = false;
+		cum_btn_states = 0;
+		add_btn_states = 0;
+	}
+}
+
+
+template <typename State>
+bool
+ButtonManager<State>::set_mode(int mode)
+{
+	if (!is_valid_mode(mode))
+		return false;
+	
+	this->mode = mode;
+	return true;
 }
 
 
+template <typename State>
 void
-ButtonManager::fire_mode_change_event()
+ButtonManager<State>::set_long_press(int duration)
 {
-	uint8_t buttons = get_norm(cum_btn_states);
+	long_press_duration = duration;
+}
+
+
+template <typename State>
+bool
+ButtonManager<State>::is_valid_mode(int mode)
+{
+	return mode >= 0 && (mode >> num_btn_mode) < num_modes;
+}
+
+
+#ifdef BUTTONS_TEST
+template <typename State>
+bool
+ButtonManager<State>::check_invariants()
+{
+	// The hold timer only runs while buttons are held, an event is only fired
+	// for a press that happened, held buttons are part of the press and the
+	// mode stays in range
+	return !(hold_started && cur_btn_states == 0)
+	    && !(event_fired && cum_btn_states == 0)
+	    && (cur_btn_states & ~cum_btn_states) == 0
+	    && is_valid_mode(mode);
+}
+#endif
+
+
+template <typename State>
+void
+ButtonManager<State>::fire_mode_change_event()
+{
+	State buttons = get_norm(cum_btn_states);
 	
 	int old_mode_type = mode & ((1<<num_btn_mode)-1);
 	int old_mode_num   = mode >> num_btn_mode;
@@ -114,10 +187,11 @@ ButtonManager::fire_mode_change_event()
 }
 
 
+template <typename State>
 void
-ButtonManager::fire_press_event(bool long_press)
+ButtonManager<State>::fire_press_event(bool long_press)
 {
-	uint8_t buttons = get_norm(cum_btn_states);
+	State buttons = get_norm(cum_btn_states);
 	bool modifiers  = get_mod(cum_btn_states);
 	
 	if (on_press)
@@ -125,18 +199,20 @@ ButtonManager::fire_press_event(bool long_press)
 }
 
 
+template <typename State>
 void
-ButtonManager::reset_hold_timer()
+ButtonManager<State>::reset_hold_timer()
 {
 	if (on_hold_start)
 		on_hold_start(!hold_started);
 	hold_started = true;
-	hold_start_time = millis();
+	hold_start_time = now;
 }
 
 
+template <typename State>
 void
-ButtonManager::stop_hold_timer(bool finished)
+ButtonManager<State>::stop_hold_timer(bool finished)
 {
 	if (hold_started && on_hold_end)
 		on_hold_end(finished && hold_timer_expired());
@@ -144,51 +220,70 @@ ButtonManager::stop_hold_timer(bool finished)
 }
 
 
+template <typename State>
 bool
-ButtonManager::hold_timer_expired()
+ButtonManager<State>::hold_timer_expired()
 {
-	return hold_started && (millis() - hold_start_time > long_press_duration);
+	return hold_started && (now - hold_start_time > long_press_duration);
 }
 
 
-bool
-ButtonManager::is_any_set(uint8_t state, const int num_masks, const uint8_t mask[])
+template <typename State>
+State
+ButtonManager<State>::combine(const int num_masks, const State mask[])
 {
-	for (int i = 0; i < num_masks; i++) {
-		if ((state & mask[i]) != 0)
-			return true;
-	}
-	return false;
+	State all = 0;
+	for (int i = 0; i < num_masks; i++)
+		all |= mask[i];
+	return all;
 }
 
 
-bool ButtonManager::is_norm(uint8_t s) {return is_any_set(s, num_btn_norm, btn_norm_masks);};
-bool ButtonManager::is_mode(uint8_t s) {return is_any_set(s, num_btn_mode, btn_mode_masks);};
-bool ButtonManager::is_mod(uint8_t s) {return is_any_set(s, num_btn_mod, btn_mod_masks);};
+template <typename State> bool ButtonManager<State>::is_norm(State s) {return (s & btn_norm_all) != 0;};
+template <typename State> bool ButtonManager<State>::is_mode(State s) {return (s & btn_mode_all) != 0;};
+template <typename State> bool ButtonManager<State>::is_mod(State s)  {return (s & btn_mod_all) != 0;};
 
 
-uint8_t
-ButtonManager::get_bits(uint8_t state, const int num_masks, const uint8_t mask[])
+template <typename State>
+State
+ButtonManager<State>::get_bits(State state, const int num_masks, const State mask[])
 {
-	uint8_t out = 0;
-	for (int i = 0; i < num_masks; i++) {
-		out |= ((state & mask[i]) != 0) << i;
-	}
+	// Shift each bit in from the top so every shift is by one
+	State out = 0;
+	for (int i = num_masks - 1; i >= 0; i--)
+		out = (out << 1) | ((state & mask[i]) != 0);
 	return out;
 }
 
 
-uint8_t ButtonManager::get_norm(uint8_t s) {return get_bits(s, num_btn_norm, btn_norm_masks);};
-uint8_t ButtonManager::get_mode(uint8_t s) {return get_bits(s, num_btn_mode, btn_mode_masks);};
-uint8_t ButtonManager::get_mod(uint8_t s)  {return get_bits(s, num_btn_mod, btn_mod_masks);};
+template <typename State> State ButtonManager<State>::get_norm(State s) {return get_bits(s, num_btn_norm, btn_norm_masks);};
+template <typename State> State ButtonManager<State>::get_mode(State s) {return get_bits(s, num_btn_mode, btn_mode_masks);};
+template <typename State> State ButtonManager<State>::get_mod(State s)  {return get_bits(s, num_btn_mod, btn_mod_masks);};
 
 
+template <typename State>
 int
-ButtonManager::get_first(uint8_t bits)
+ButtonManager<State>::get_first(State bits)
 {
-	for (int i = 0; i < 8; i++)
-		if ((bits>>i)&0x1)
-			return i;
+	// Isolate the lowest set bit (x & -x)
+	bits &= (State)(~bits + 1);
+	
+	// Binary search for its position without branching or dividing: each
+	// constant mask gives one bit of the index. The size tests are resolved
+	// at compile time.
+	int first = ((bits & (State)0xAAAAAAAAul) != 0)
+	          | ((bits & (State)0xCCCCCCCCul) != 0) << 1
+	          | ((bits & (State)0xF0F0F0F0ul) != 0) << 2;
+	if (sizeof(State) > 1)
+		first |= ((bits & (State)0xFF00FF00ul) != 0) << 3;
+	if (sizeof(State) > 2)
+		first |= ((bits & (State)0xFFFF0000ul) != 0) << 4;
 	
-	return 0;
+	return first;
 }
+
+
+// The widths of button state supported
+template class ButtonManager<uint8_t>;
+template class ButtonManager<uint16_t>;
+template class ButtonManager<uint32_t>;
@@ -2,56 +2,82 @@
 #define BUTTONS_H
 
 #include <WProgram.h>
+#include <Tick.h>
 
 
+// State is the unsigned type holding one bit per button (uint8_t, uint16_t or
+// uint32_t).
+template <typename State>
 class ButtonManager {
 	public:
 		ButtonManager(const int long_press_duration,
                   const int     num_modes,
                   const int     num_btn_norm,
-                  const uint8_t btn_norm_masks[],
+                  const State   btn_norm_masks[],
                   const int     num_btn_mode,
-                  const uint8_t btn_mode_masks[],
+                  const State   btn_mode_masks[],
                   const int     num_btn_mod,
-                  const uint8_t btn_mod_masks[]);
+                  const State   btn_mod_masks[]);
 		
 		// Register the current state of a button
-		void set_btn_states(uint8_t new_btn_states);
+		void set_btn_states(State new_btn_states);
+		
+		// Register the current state of a button at the given time (ms)
+		void set_btn_states(State new_btn_states, unsigned long now);
+		void set_btn_states(State new_btn_states, const Tick &tick);
+		
+		// Change the mode, returns false if it is out of range
+		bool set_mode(int mode);
+		
+		// Change the length of a long-press (ms)
+		void set_long_press(int duration);
 	
 	private:
 		// Length of a long-press in milliseconds
-		const int long_press_duration;
+		int long_press_duration;
 		
 		// Number of modes per mode button
 		int num_modes;
 		
 		// Normal buttons
 		const int     num_btn_norm;
-		const uint8_t *btn_norm_masks;
+		const State   *btn_norm_masks;
 		
 		// Mode buttons
 		const int     num_btn_mode;
-		const uint8_t *btn_mode_masks;
+		const State   *btn_mode_masks;
 		
 		// Modifiers
 		const int     num_btn_mod;
-		const uint8_t *btn_mod_masks;
+		const State   *btn_mod_masks;
+		
+		// Every button of each kind, so each test is a single AND
+		const State   btn_norm_all;
+		const State   btn_mode_all;
+		const State   btn_mod_all;
 	
 	
 	public:
 		int mode;
+		
+#ifdef BUTTONS_TEST
+		// Is the state machine consistent (host test builds only)
+		bool check_invariants();
+#endif
 	
 	private:
-		uint8_t cur_btn_states; // Currently pressed buttons
-		uint8_t cum_btn_states; // (Cumaltive) pressed buttons
-		uint8_t add_btn_states; // Newly pressed (added) buttons
-		uint8_t sub_btn_states; // Newly depressed (subtracted) buttons
+		State cur_btn_states; // Currently pressed buttons
+		State cum_btn_states; // (Cumaltive) pressed buttons
+		State add_btn_states; // Newly pressed (added) buttons
+		State sub_btn_states; // Newly depressed (subtracted) buttons
 		
 		bool hold_started;
 		unsigned long hold_start_time;
 		
 		bool event_fired; // Has an event been fired for this key press
 		
+		unsigned long now; // Time of the current update
+		
 		void fire_mode_change_event();
 		void fire_press_event(bool long_press);
 		
@@ -59,23 +85,25 @@ class ButtonManager {
 		void reset_hold_timer();
 		bool hold_timer_expired();
 		
-		bool is_any_set(uint8_t state, const int num_masks, const uint8_t mask[]);
+		bool is_valid_mode(int mode);
+		
+		static State combine(const int num_masks, const State mask[]);
 		
-		bool is_norm(uint8_t state);
-		bool is_mode(uint8_t state);
-		bool is_mod(uint8_t state);
+		bool is_norm(State state);
+		bool is_mode(State state);
+		bool is_mod(State state);
 		
-		uint8_t get_bits(uint8_t state, const int num_masks, const uint8_t mask[]);
+		State get_bits(State state, const int num_masks, const State mask[]);
 		
-		uint8_t get_norm(uint8_t state);
-		uint8_t get_mode(uint8_t state);
-		uint8_t get_mod(uint8_t state);
+		State get_norm(State state);
+		State get_mode(State state);
+		State get_mod(State state);
 		
-		int get_first(uint8_t bits);
+		int get_first(State bits);
 	
 	public:
 		void (*on_mode_change)(int mode);
-		void (*on_press)(int mode, uint8_t modifiers, bool long_press, uint8_t buttons);
+		void (*on_press)(int mode, State modifiers, bool long_press, State buttons);
 		
 		void (*on_hold_start)(bool starting);
 		void (*on_hold_end)(bool finished);
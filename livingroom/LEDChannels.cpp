@@ -0,0 +1,120 @@
+#include <WProgram.h>
+#include "LEDChannels.h"
+
+
+LEDChannels::LEDChannels(void (*write)(uint8_t pin, uint8_t level))
+	: write(write)
+	, num_channels(0)
+	, last_refresh(0)
+{
+	// Do nothing
+}
+
+
+LEDChannels::~LEDChannels()
+{
+	// Do nothing
+}
+
+
+int
+LEDChannels::add(uint8_t pin)
+{
+	if (num_channels == MAX_CHANNELS)
+		return -1;
+	
+	pins[num_channels]      = pin;
+	targets[num_channels]   = 0;
+	levels[num_channels]    = 0;
+	rates[num_channels]     = 0;
+	remaining[num_channels] = 0;
+	write(pin, 0);
+	
+	last_refresh = millis();
+	return num_channels++;
+}
+
+
+int LEDChannels::get_num_channels() { return num_channels; }
+uint8_t LEDChannels::get(int channel) { return levels[channel] >> 8; }
+
+
+void
+LEDChannels::set(int channel, uint8_t level, int duration)
+{
+	if (channel < 0 || channel >= num_channels)
+		return;
+	
+	uint16_t steps = duration / UPDATE_PERIOD;
+	targets[channel] = level;
+	
+	if (steps < 2) {
+		// Too short to fade (and the rate may not fit), change immediately
+		levels[channel] = (uint16_t)level << 8;
+		remaining[channel] = 0;
+		write(pins[channel], level);
+		return;
+	}
+	
+	long delta = ((long)level << 8) - levels[channel];
+	rates[channel] = delta / steps;
+	remaining[channel] = steps;
+}
+
+
+void
+LEDChannels::refresh()
+{
+	Tick tick;
+	tick_capture(tick);
+	refresh(tick);
+}
+
+
+void
+LEDChannels::refresh(const Tick &tick)
+{
+	unsigned long delta_steps = (tick.ms - last_refresh) / UPDATE_PERIOD;
+	last_refresh += delta_steps * UPDATE_PERIOD;
+	
+	if (delta_steps != 0)
+		advance(delta_steps > 0xFFFF ? 0xFFFF : delta_steps);
+}
+
+
+void
+LEDChannels::advance(uint16_t steps)
+{
+	for (uint8_t i = 0; i < num_channels; i++) {
+		if (remaining[i] == 0)
+			continue;
+		
+		if (steps >= remaining[i]) {
+			// Finished, land exactly on the target
+			remaining[i] = 0;
+			levels[i] = (uint16_t)targets[i] << 8;
+		} else {
+			remaining[i] -= steps;
+			levels[i] += (uint16_t)(rates[i] * (long)steps);
+		}
+		
+		write(pins[i], levels[i] >> 8);
+	}
+}
+
+
+bool
+LEDChannels::is_busy()
+{
+	for (uint8_t i = 0; i < num_channels; i++)
+		if (remaining[i] != 0)
+			return true;
+	return false;
+}
+
+
+unsigned long
+LEDChannels::next_refresh()
+{
+	return last_refresh + UPDATE_PERIOD;
+}
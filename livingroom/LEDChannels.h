@@ -0,0 +1,62 @@
+#ifndef LEDCHANNELS_H
+#define LEDCHANNELS_H
+
+#include <WProgram.h>
+#include <Tick.h>
+
+
+/* Fades a number of single-colour LED channels. The channels are held as
+ * parallel arrays and all advanced together in one pass per update period.
+ * Levels are tracked in 8.8 fixed point and stepped by a precomputed rate so
+ * no division is needed while fading.
+ */
+class LEDChannels {
+	public:
+		static const int MAX_CHANNELS = 8;
+		
+		// Channel levels are output through the given function which is
+		// passed the pin the channel was added with
+		LEDChannels(void (*write)(uint8_t pin, uint8_t level));
+		~LEDChannels();
+		
+		// Add a channel, returns its index or -1 if there's no room
+		int add(uint8_t pin);
+		
+		int get_num_channels();
+		
+		// Fade a channel to the given level in the given duration (ms)
+		void set(int channel, uint8_t level, int duration);
+		
+		// Current level of a channel
+		uint8_t get(int channel);
+		
+		// Advance any fades
+		void refresh();
+		void refresh(const Tick &tick);
+		
+		// Is a fade in progress?
+		bool is_busy();
+		
+		// The time at which the next step of a fade is due
+		unsigned long next_refresh();
+		
+		static const int UPDATE_PERIOD = 10;
+	
+	private:
+		void (*write)(uint8_t pin, uint8_t level);
+		
+		uint8_t num_channels;
+		
+		uint8_t  pins[MAX_CHANNELS];
+		uint8_t  targets[MAX_CHANNELS];   // Target level
+		uint16_t levels[MAX_CHANNELS];    // Current level (8.8 fixed point)
+		int16_t  rates[MAX_CHANNELS];     // Change in level per step
+		uint16_t remaining[MAX_CHANNELS]; // Steps left in the fade
+		
+		unsigned long last_refresh;
+		
+		void advance(uint16_t steps);
+};
+
+
+#endif
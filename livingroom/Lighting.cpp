@@ -2,9 +2,13 @@
 #include "Lighting.h"
 
 
-Lighting::Lighting(int pin, int off_angle, int idle_angle, int on_angle)
-	: pin(pin)
+Lighting::Lighting(ServoPulse *servos, int pin,
+                   int off_angle, int idle_angle, int on_angle)
+	: servos(servos)
+	, pin(pin)
+	, slot(-1)
 	, state(false)
+	, hold(false)
 	, off_angle(off_angle)
 	, idle_angle(idle_angle)
 	, on_angle(on_angle)
@@ -20,19 +24,43 @@ Lighting::~Lighting(){}
 void
 Lighting::set(bool new_state)
 {
-	servo.attach(pin);
-	servo.write(new_state ? on_angle : off_angle);
+	Tick tick;
+	tick_capture(tick);
+	set(new_state, tick);
+}
+
+
+void
+Lighting::set(bool new_state, const Tick &tick)
+{
+	if (slot < 0)
+		return;
+	
+	servos->write(slot, new_state ? on_angle : off_angle);
 	state = new_state;
-	last_change = millis();
+	last_change = tick.ms;
 }
 
 
 void
 Lighting::init()
 {
-	servo.attach(pin);
-	servo.write(idle_angle);
-	last_change = millis();
+	Tick tick;
+	tick_capture(tick);
+	init(tick);
+}
+
+
+void
+Lighting::init(const Tick &tick)
+{
+	if (slot < 0)
+		slot = servos->add(pin);
+	if (slot < 0)
+		return;
+	
+	servos->write(slot, idle_angle);
+	last_change = tick.ms;
 }
 
 
@@ -43,17 +71,36 @@ Lighting::get()
 }
 
 
+void
+Lighting::sync(bool new_state)
+{
+	state = new_state;
+}
+
+
 void
 Lighting::refresh()
 {
-	unsigned long delta = millis() - last_change;
+	Tick tick;
+	tick_capture(tick);
+	refresh(tick);
+}
+
+
+void
+Lighting::refresh(const Tick &tick)
+{
+	unsigned long delta = tick.ms - last_change;
 	bool time_pressed_expired = delta > TIME_PRESSED;
 	bool time_off_expired = delta > TIME_PRESSED + TIME_OFF;
 	
-	if (time_pressed_expired && !time_off_expired && servo.read() != idle_angle) {
-		servo.write(idle_angle);
-	} else if (time_off_expired && servo.attached()) {
-		servo.detach();
+	if (slot < 0)
+		return;
+	
+	if (time_pressed_expired && !time_off_expired && servos->read(slot) != idle_angle) {
+		servos->write(slot, idle_angle);
+	} else if (time_off_expired && !hold && servos->is_active(slot)) {
+		servos->release(slot);
 	}
 }
 
@@ -61,6 +108,33 @@ Lighting::refresh()
 bool
 Lighting::is_busy()
 {
-	unsigned long delta = millis() - last_change;
+	Tick tick;
+	tick_capture(tick);
+	return is_busy(tick);
+}
+
+
+bool
+Lighting::is_busy(const Tick &tick)
+{
+	unsigned long delta = tick.ms - last_change;
 	return delta < TIME_PRESSED + TIME_OFF;
 }
+
+
+void
+Lighting::set_hold(bool hold)
+{
+	this->hold = hold;
+	if (hold && slot >= 0 && !servos->is_active(slot))
+		servos->write(slot, idle_angle);
+}
+
+
+void
+Lighting::set_angles(int off_angle, int idle_angle, int on_angle)
+{
+	this->off_angle  = off_angle;
+	this->idle_angle = idle_angle;
+	this->on_angle   = on_angle;
+}
@@ -2,26 +2,44 @@
 #define LIGHTING_H
 
 #include <WProgram.h>
-#include "Servo.h"
+#include <ServoPulse.h>
+#include <Tick.h>
 
 class Lighting {
 	public:
-		Lighting(int pin, int off_angle, int idle_angle, int on_angle);
+		Lighting(ServoPulse *servos, int pin,
+		         int off_angle, int idle_angle, int on_angle);
 		~Lighting();
 		
 		void init();
+		void init(const Tick &tick);
 		void set(bool state);
+		void set(bool state, const Tick &tick);
 		bool get();
 		
+		// Record the light's state without moving the servo (eg. when it was
+		// switched by hand)
+		void sync(bool state);
+		
 		void refresh();
+		void refresh(const Tick &tick);
 		
 		bool is_busy();
+		bool is_busy(const Tick &tick);
+		
+		// Change the angles used from the next movement on
+		void set_angles(int off_angle, int idle_angle, int on_angle);
+		
+		// Keep pulsing the servo at its idle angle rather than releasing it
+		void set_hold(bool hold);
 	
 	private:
+		ServoPulse *servos;
 		int pin;
-		Servo servo;
+		int slot;
 		
 		bool state;
+		bool hold;
 		
 		int off_angle;
 		int idle_angle;
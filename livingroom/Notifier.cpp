@@ -0,0 +1,97 @@
+#include <WProgram.h>
+#include "Notifier.h"
+
+
+Notifier::Notifier()
+	: num_watches(0)
+	, total_bits(0)
+	, min_interval(0)
+	, last_frame(0)
+	, dirty(false)
+	, last_push(0)
+{
+	// Do nothing
+}
+
+
+bool Notifier::watch(const int *value, uint8_t bits) { return add(value, NULL, bits); }
+bool Notifier::watch(int (*getter)(), uint8_t bits)  { return add(NULL, getter, bits); }
+
+
+bool
+Notifier::add(const int *value, int (*getter)(), uint8_t bits)
+{
+	if (num_watches == MAX_WATCHES || total_bits + bits > 16)
+		return false;
+	
+	values[num_watches]  = value;
+	getters[num_watches] = getter;
+	this->bits[num_watches] = bits;
+	
+	num_watches++;
+	total_bits += bits;
+	return true;
+}
+
+
+void
+Notifier::set_interval(unsigned int interval)
+{
+	min_interval = interval;
+	
+	// Push the current state straight away so the receiver has a baseline
+	last_frame = pack();
+	dirty = true;
+	last_push = millis() - interval;
+}
+
+
+unsigned int Notifier::get_interval() { return min_interval; }
+uint16_t Notifier::frame() { return last_frame; }
+
+
+bool
+Notifier::refresh()
+{
+	Tick tick;
+	tick_capture(tick);
+	return refresh(tick);
+}
+
+
+bool
+Notifier::refresh(const Tick &tick)
+{
+	if (min_interval == 0)
+		return false;
+	
+	uint16_t new_frame = pack();
+	if (new_frame != last_frame) {
+		last_frame = new_frame;
+		dirty = true;
+	}
+	
+	// Hold back until the interval has passed, batching further changes
+	if (!dirty || tick.ms - last_push < min_interval)
+		return false;
+	
+	dirty = false;
+	last_push = tick.ms;
+	return true;
+}
+
+
+uint16_t
+Notifier::pack()
+{
+	uint16_t out = 0;
+	uint8_t shift = 0;
+	
+	for (int i = 0; i < num_watches; i++) {
+		int value = values[i] ? *values[i] : getters[i]();
+		out |= (value & ((1ul << bits[i]) - 1)) << shift;
+		shift += bits[i];
+	}
+	
+	return out;
+}
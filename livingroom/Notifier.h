@@ -0,0 +1,55 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <WProgram.h>
+#include <Tick.h>
+
+
+/* Watches a set of small integer values and packs them into a single 16-bit
+ * frame which is pushed whenever any of them change. Values are packed from
+ * the least significant bit upwards in the order they were added. Changes
+ * made within min_interval of the last push are batched into the next frame.
+ */
+class Notifier {
+	public:
+		static const int MAX_WATCHES = 8;
+		
+		Notifier();
+		
+		// Watch a value directly or through a getter, using the given number of
+		// bits in the frame. Returns false if the frame is full.
+		bool watch(const int *value, uint8_t bits);
+		bool watch(int (*getter)(), uint8_t bits);
+		
+		// Enable pushing with the given minimum interval between frames (ms).
+		// An interval of zero disables pushing.
+		void set_interval(unsigned int interval);
+		unsigned int get_interval();
+		
+		// Check the watched values, returns true if a frame is ready to send
+		bool refresh();
+		bool refresh(const Tick &tick);
+		
+		// The most recently prepared frame
+		uint16_t frame();
+	
+	private:
+		const int *values[MAX_WATCHES];
+		int (*getters[MAX_WATCHES])();
+		uint8_t bits[MAX_WATCHES];
+		
+		uint8_t num_watches;
+		uint8_t total_bits;
+		
+		unsigned int min_interval;
+		
+		uint16_t last_frame; // Most recently packed frame
+		bool dirty;          // Has a value changed since the last push
+		unsigned long last_push;
+		
+		bool add(const int *value, int (*getter)(), uint8_t bits);
+		uint16_t pack();
+};
+
+
+#endif
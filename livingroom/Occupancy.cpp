@@ -0,0 +1,65 @@
+#include <WProgram.h>
+#include "Occupancy.h"
+
+
+Occupancy::Occupancy(unsigned long window, unsigned long timeout)
+	: bucket(0)
+	, bucket_start(0)
+	, bucket_length(window / NUM_BUCKETS)
+	, sensor_state(false)
+	, occupied(false)
+	, last_trigger(0)
+	, timeout(timeout)
+{
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+
+bool
+Occupancy::update(bool new_sensor_state, unsigned long now)
+{
+	// Slide the window along, dropping old buckets
+	for (int i = 0; i < NUM_BUCKETS && now - bucket_start >= bucket_length; i++) {
+		bucket = (bucket + 1) % NUM_BUCKETS;
+		buckets[bucket] = 0;
+		bucket_start += bucket_length;
+	}
+	if (now - bucket_start >= bucket_length)
+		// Everything is stale, restart the window
+		bucket_start = now;
+	
+	bool was_occupied = occupied;
+	
+	if (new_sensor_state) {
+		// Triggered (counted once per trigger), motion held for a while
+		// keeps the room occupied
+		if (!sensor_state && buckets[bucket] != 0xFF)
+			buckets[bucket]++;
+		last_trigger = now;
+		occupied = true;
+	} else if (occupied && now - last_trigger > timeout) {
+		// Nothing seen for a while
+		occupied = false;
+	}
+	
+	sensor_state = new_sensor_state;
+	return occupied != was_occupied;
+}
+
+
+bool Occupancy::is_occupied() { return occupied; }
+
+
+int
+Occupancy::get_motion_level()
+{
+	int level = 0;
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		level += buckets[i];
+	return level;
+}
+
+
+void Occupancy::set_timeout(unsigned long timeout) { this->timeout = timeout; }
+unsigned long Occupancy::get_timeout() { return timeout; }
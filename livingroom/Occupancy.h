@@ -0,0 +1,44 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <WProgram.h>
+
+
+/* Tracks room occupancy from a motion sensor. Triggers are counted over a
+ * sliding window (split into buckets) to give a motion level and the room is
+ * considered vacant once the sensor has been clear for the timeout.
+ */
+class Occupancy {
+	public:
+		static const int NUM_BUCKETS = 8;
+		
+		// Window and timeout in milliseconds
+		Occupancy(unsigned long window, unsigned long timeout);
+		
+		// Register the sensor state, returns true if the occupancy changed
+		bool update(bool sensor_state, unsigned long now);
+		
+		bool is_occupied();
+		
+		// Number of triggers in the last window
+		int get_motion_level();
+		
+		void set_timeout(unsigned long timeout);
+		unsigned long get_timeout();
+	
+	private:
+		// Triggers counted in each part of the window
+		uint8_t buckets[NUM_BUCKETS];
+		uint8_t bucket;
+		unsigned long bucket_start;
+		unsigned long bucket_length;
+		
+		bool sensor_state;
+		bool occupied;
+		
+		unsigned long last_trigger;
+		unsigned long timeout;
+};
+
+
+#endif
@@ -6,14 +6,19 @@ RGBLED::RGBLED(int pin_r, int pin_g, int pin_b)
 	: pin_r(pin_r)
 	, pin_g(pin_g)
 	, pin_b(pin_b)
-	, step(0)
-	, num_steps(1)
 	, last_refresh(0)
 {
-	// Do nothing
-	new_col.r = old_col.r = cur_col.r = 255;
-	new_col.g = old_col.g = cur_col.g = 255;
-	new_col.b = old_col.b = cur_col.b = 255;
+	// Start with an opaque white base and nothing above it
+	for (int i = 0; i < NUM_LAYERS; i++) {
+		Layer &l = layers[i];
+		for (int c = 0; c < 4; c++)
+			l.old_val[c] = l.new_val[c] = l.cur_val[c] = (i == 0) ? 255 : 0;
+		l.step = 0;
+		l.num_steps = 1;
+		l.easing = EASE_LINEAR;
+	}
+	
+	cur_col.r = cur_col.g = cur_col.b = 255;
 }
 
 RGBLED::~RGBLED()
@@ -36,34 +41,82 @@ void RGBLED::refresh() { refresh(false); }
 
 void
 RGBLED::refresh(bool force)
+{
+	Tick tick;
+	tick_capture(tick);
+	refresh(tick);
+}
+
+
+void
+RGBLED::refresh(const Tick &tick)
 {
 	// Calculate the step number
-	unsigned long delta_steps = (millis() - last_refresh) / UPDATE_PERIOD;
+	unsigned long delta_steps = (tick.ms - last_refresh) / UPDATE_PERIOD;
 	last_refresh += delta_steps * UPDATE_PERIOD;
-	step = step + delta_steps;
 	
 	// No point continuing if the LED wont change
 	//if (delta_steps == 0 && !force)
 	//	return;
 	
-	if (step >= num_steps) {
-		// Cycle has finished, make colour constant
-		step = 0;
-		old_col.r = new_col.r;
-		old_col.g = new_col.g;
-		old_col.b = new_col.b;
+	advance(delta_steps);
+	update();
+}
+
+
+void
+RGBLED::advance(unsigned long steps)
+{
+	for (int i = 0; i < NUM_LAYERS; i++) {
+		Layer &l = layers[i];
+		
+		if (steps >= (unsigned long)(l.num_steps - l.step)) {
+			// Cycle has finished, make colour constant
+			l.step = 0;
+			for (int c = 0; c < 4; c++)
+				l.old_val[c] = l.new_val[c];
+		} else {
+			l.step += steps;
+		}
 	}
+}
+
+
+void
+RGBLED::update()
+{
+	int out[3] = {0, 0, 0};
 	
-	// Get deltas for new and old colours
-	Colour delta;
-	delta.r = new_col.r - old_col.r;
-	delta.g = new_col.g - old_col.g;
-	delta.b = new_col.b - old_col.b;
+	for (int i = 0; i < NUM_LAYERS; i++) {
+		Layer &l = layers[i];
+		
+		// Progress through the fade (0-256), a settled layer needs no division
+		if (l.step != 0) {
+			int t = ease(l.easing, ((long)l.step << 8) / l.num_steps);
+			
+			// Calculate the current colour of the layer
+			for (int c = 0; c < 4; c++) {
+				int delta = l.new_val[c] - l.old_val[c];
+				l.cur_val[c] = l.old_val[c] + (((long)delta * t) >> 8);
+			}
+		} else {
+			for (int c = 0; c < 4; c++)
+				l.cur_val[c] = l.old_val[c];
+		}
+		
+		// Draw it over the layers below
+		int alpha = (i == 0) ? 255 : l.cur_val[3];
+		for (int c = 0; c < 3; c++) {
+			if (alpha == 255)
+				out[c] = l.cur_val[c];
+			else if (alpha != 0)
+				out[c] += ((long)(l.cur_val[c] - out[c]) * alpha + 127) >> 8;
+		}
+	}
 	
-	// Calculate the current colour for the lights
-	cur_col.r = old_col.r + ((delta.r * step) / num_steps);
-	cur_col.g = old_col.g + ((delta.g * step) / num_steps);
-	cur_col.b = old_col.b + ((delta.b * step) / num_steps);
+	cur_col.r = out[0];
+	cur_col.g = out[1];
+	cur_col.b = out[2];
 	
 	// Set the LED pins
 	analogWrite(pin_r, 255 - cur_col.r);
@@ -75,17 +128,116 @@ RGBLED::refresh(bool force)
 void
 RGBLED::set_colour(const Colour &colour, int duration)
 {
-	// The "old" colour is now the new one
-	old_col.r = cur_col.r;
-	old_col.g = cur_col.g;
-	old_col.b = cur_col.b;
+	set_colour(colour, duration, EASE_LINEAR);
+}
+
+
+void
+RGBLED::set_colour(const Colour &colour, int duration, Easing easing)
+{
+	start_fade(0, colour, 255, duration, easing);
+}
+
+
+void
+RGBLED::set_layer(int layer, const Colour &colour, int duration)
+{
+	set_layer(layer, colour, duration, EASE_LINEAR);
+}
+
+
+void
+RGBLED::set_layer(int layer, const Colour &colour, int duration, Easing easing)
+{
+	start_fade(layer, colour, 255, duration, easing);
+}
+
+
+void
+RGBLED::clear_layer(int layer, int duration)
+{
+	// The colour is ignored when fading out
+	Colour colour;
+	colour.r = colour.g = colour.b = 0;
+	start_fade(layer, colour, 0, duration, EASE_LINEAR);
+}
+
+
+void
+RGBLED::start_fade(int layer, const Colour &colour, uint8_t alpha,
+                   int duration, Easing easing)
+{
+	Layer &l = layers[layer];
+	
+	// The "old" colour is now the current one
+	for (int c = 0; c < 4; c++)
+		l.old_val[c] = l.cur_val[c];
 	
-	// Set the new target colour
-	new_col.r = colour.r;
-	new_col.g = colour.g;
-	new_col.b = colour.b;
+	if (alpha != 0) {
+		// A hidden layer should fade in with its new colour
+		if (l.cur_val[3] == 0) {
+			l.old_val[0] = colour.r;
+			l.old_val[1] = colour.g;
+			l.old_val[2] = colour.b;
+		}
+		
+		// Set the new target colour
+		l.new_val[0] = colour.r;
+		l.new_val[1] = colour.g;
+		l.new_val[2] = colour.b;
+	} else {
+		// Fade out in the current colour
+		l.new_val[0] = l.cur_val[0];
+		l.new_val[1] = l.cur_val[1];
+		l.new_val[2] = l.cur_val[2];
+	}
+	l.new_val[3] = alpha;
 	
 	// Set up the duration of the transition
-	step = 0;
-	num_steps = (duration / UPDATE_PERIOD) + 1;
+	l.step = 0;
+	l.num_steps = (duration / UPDATE_PERIOD) + 1;
+	l.easing = easing;
+	
+	if (l.num_steps == 1) {
+		// Change immediately
+		for (int c = 0; c < 4; c++)
+			l.old_val[c] = l.cur_val[c] = l.new_val[c];
+	}
+}
+
+
+int
+RGBLED::ease(Easing easing, int t)
+{
+	switch (easing) {
+		case EASE_IN:
+			return ((long)t * t) >> 8;
+		
+		case EASE_OUT:
+			return 256 - (((long)(256 - t) * (256 - t)) >> 8);
+		
+		case EASE_IN_OUT:
+			return ((long)t * t * (768 - 2*t)) >> 16;
+		
+		default:
+			return t;
+	}
+}
+
+
+bool
+RGBLED::is_busy()
+{
+	for (int i = 0; i < NUM_LAYERS; i++)
+		for (int c = 0; c < 4; c++)
+			if (layers[i].old_val[c] != layers[i].new_val[c])
+				return true;
+	return false;
+}
+
+
+unsigned long
+RGBLED::next_refresh()
+{
+	return last_refresh + UPDATE_PERIOD;
 }
@@ -2,17 +2,31 @@
 #define RGBLED_H
 
 #include <WProgram.h>
+#include <Tick.h>
 
 
 struct Colour {
-	int r;
-	int g;
-	int b;
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
+
+
+// Fade progress curves
+enum Easing {
+	EASE_LINEAR = 0,
+	EASE_IN,
+	EASE_OUT,
+	EASE_IN_OUT,
 };
 
 
 class RGBLED {
 	public:
+		// Layers are drawn in order with higher layers over lower ones. Layer 0
+		// is the base colour and is always opaque.
+		static const int NUM_LAYERS = 4;
+		
 		RGBLED(int pin_r, int pin_g, int pin_b);
 		~RGBLED();
 		
@@ -22,27 +36,66 @@ class RGBLED {
 		// Update the colour
 		void refresh(bool force);
 		void refresh();
+		void refresh(const Tick &tick);
 		
-		// Fade the LED from the current colour to the specified one in the
-		// specified duration
+		// Fade the base layer from the current colour to the specified one in
+		// the specified duration. Durations shorter than UPDATE_PERIOD take
+		// effect immediately.
 		void set_colour(const Colour &colour, int duration);
+		void set_colour(const Colour &colour, int duration, Easing easing);
+		
+		// Fade a layer in to the specified colour over the layers below it
+		void set_layer(int layer, const Colour &colour, int duration);
+		void set_layer(int layer, const Colour &colour, int duration, Easing easing);
+		
+		// Fade a layer out, revealing the layers below it
+		void clear_layer(int layer, int duration);
+		
+		// Is a fade in progress?
+		bool is_busy();
+		
+		// The time at which the next step of a fade is due
+		unsigned long next_refresh();
 	
 	private:
 		int pin_r;
 		int pin_g;
 		int pin_b;
 		
-	public:
-		Colour cur_col; // Current colour
-		Colour old_col; // Old colour
-		Colour new_col; // Target colour
+		// Fade state of a layer, channels are red, green, blue then alpha
+		struct Layer {
+			uint8_t old_val[4]; // Old value
+			uint8_t new_val[4]; // Target value
+			uint8_t cur_val[4]; // Current value
+			
+			uint16_t step;
+			uint16_t num_steps;
+			
+			Easing easing;
+		};
 		
-		int step;
-		int num_steps;
+		Layer layers[NUM_LAYERS];
+	
+	public:
+		Colour cur_col; // Current (composited) colour
 		
 		unsigned long last_refresh;
 		
 		static const int UPDATE_PERIOD = 10;
+	
+	private:
+		// Start a fade
+		void start_fade(int layer, const Colour &colour, uint8_t alpha,
+		                int duration, Easing easing);
+		
+		// Advance the fades by a number of steps
+		void advance(unsigned long steps);
+		
+		// Calculate the current colour and set the pins
+		void update();
+		
+		// Map fade progress (0-256) through an easing curve
+		int ease(Easing easing, int t);
 };
 
 
@@ -0,0 +1,111 @@
+#include <WProgram.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "ServoPulse.h"
+
+
+ServoPulse *volatile ServoPulse::active = NULL;
+
+
+ISR(TIMER1_COMPA_vect)
+{
+	if (ServoPulse::active)
+		ServoPulse::active->interrupt();
+}
+
+
+ServoPulse::ServoPulse()
+	: num_slots(0)
+	, cur_slot(0)
+	, pulse_high(false)
+	, slot_start(0)
+{
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		angles[i] = -1;
+		widths[i] = 0;
+	}
+}
+
+
+int
+ServoPulse::add(int pin)
+{
+	if (num_slots == NUM_SLOTS)
+		return -1;
+	
+	ports[num_slots] = portOutputRegister(digitalPinToPort(pin));
+	masks[num_slots] = digitalPinToBitMask(pin);
+	digitalWrite(pin, LOW);
+	pinMode(pin, OUTPUT);
+	
+	return num_slots++;
+}
+
+
+void
+ServoPulse::begin()
+{
+	active = this;
+	
+	// Normal mode, 16MHz/8 = 0.5us ticks, slots are timed with compare A
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11);
+	TCNT1 = 0;
+	slot_start = 0;
+	OCR1A = SLOT_TICKS;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+}
+
+
+void
+ServoPulse::write(int slot, int angle)
+{
+	angle = constrain(angle, 0, 180);
+	angles[slot] = angle;
+	
+	long us = MIN_PULSE + ((long)(MAX_PULSE - MIN_PULSE) * angle) / 180;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		widths[slot] = us * 2;
+	}
+}
+
+
+void
+ServoPulse::release(int slot)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		widths[slot] = 0;
+	}
+}
+
+
+int ServoPulse::read(int slot) { return angles[slot]; }
+bool ServoPulse::is_active(int slot) { return widths[slot] != 0; }
+
+
+void
+ServoPulse::interrupt()
+{
+	if (pulse_high) {
+		// End of a pulse, wait for the next slot
+		*ports[cur_slot] &= ~masks[cur_slot];
+		pulse_high = false;
+		OCR1A = slot_start + SLOT_TICKS;
+		return;
+	}
+	
+	// Start of a slot
+	slot_start = OCR1A;
+	cur_slot = (cur_slot + 1) % NUM_SLOTS;
+	
+	uint16_t width = (cur_slot < num_slots) ? widths[cur_slot] : 0;
+	if (width) {
+		*ports[cur_slot] |= masks[cur_slot];
+		pulse_high = true;
+		OCR1A = slot_start + width;
+	} else {
+		OCR1A = slot_start + SLOT_TICKS;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef SERVOPULSE_H
+#define SERVOPULSE_H
+
+#include <WProgram.h>
+
+
+/* Generates servo pulses for a number of pins from Timer1. The 20ms frame is
+ * split into one slot per servo and each servo's pulse starts at the
+ * beginning of its own slot, so only one pulse is ever high at a time. A
+ * servo can be released (no pulses, holding by friction) and written again
+ * without any attach/detach.
+ */
+class ServoPulse {
+	public:
+		static const int NUM_SLOTS = 8;
+		
+		// Pulse widths (us) for 0 and 180 degrees, as the Servo library
+		static const int MIN_PULSE = 544;
+		static const int MAX_PULSE = 2400;
+		
+		ServoPulse();
+		
+		// Claim a slot for a pin, returns -1 if they are all in use
+		int add(int pin);
+		
+		// Take over Timer1 and start the frame
+		void begin();
+		
+		// Start (or keep) pulsing a slot for the given angle
+		void write(int slot, int angle);
+		
+		// Stop pulsing a slot, the servo is left where it is
+		void release(int slot);
+		
+		// The angle last written to a slot and whether it is being pulsed
+		int read(int slot);
+		bool is_active(int slot);
+		
+		// Called from the Timer1 compare interrupt
+		void interrupt();
+		
+		// The engine receiving interrupts
+		static ServoPulse *volatile active;
+	
+	private:
+		// Output register and bit of each slot's pin, so the interrupt can
+		// write the pin directly
+		volatile uint8_t *ports[NUM_SLOTS];
+		uint8_t masks[NUM_SLOTS];
+		uint8_t num_slots;
+		
+		int angles[NUM_SLOTS];
+		
+		// Pulse width of each slot in timer ticks (0 when released)
+		volatile uint16_t widths[NUM_SLOTS];
+		
+		// Interrupt state
+		uint8_t cur_slot;
+		bool pulse_high;
+		uint16_t slot_start;
+		
+		// Timer ticks (0.5us) per slot
+		static const uint16_t SLOT_TICKS = 20000u / NUM_SLOTS * 2u;
+};
+
+
+#endif
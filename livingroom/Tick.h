@@ -0,0 +1,25 @@
+#ifndef TICK_H
+#define TICK_H
+
+#include <WProgram.h>
+
+
+/* The time at the start of a pass of the main loop. Everything refreshed in
+ * that pass sees the same time and the clock is only read once.
+ */
+struct Tick {
+	unsigned long ms;
+	unsigned long us;
+};
+
+
+// Read the clock into a tick
+inline void
+tick_capture(Tick &tick)
+{
+	tick.ms = millis();
+	tick.us = micros();
+}
+
+
+#endif
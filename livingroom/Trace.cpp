@@ -0,0 +1,80 @@
+#include <WProgram.h>
+#include "Trace.h"
+
+
+Trace::Trace()
+	: head(0)
+	, count(0)
+	, recording(false)
+	, wrap(false)
+	, last_time(0)
+{
+	// Do nothing
+}
+
+
+void
+Trace::start(bool wrap)
+{
+	this->wrap = wrap;
+	head = 0;
+	count = 0;
+	last_time = millis();
+	recording = true;
+}
+
+
+void Trace::stop() { recording = false; }
+bool Trace::is_recording() { return recording; }
+int Trace::length() { return count; }
+
+
+void
+Trace::record(uint8_t kind, uint16_t value)
+{
+	if (!recording)
+		return;
+	
+	unsigned long now = millis();
+	unsigned long delta = now - last_time;
+	last_time = now;
+	
+	// Too long to fit in a single record
+	if (delta > 0xFFFF)
+		append(0, TRACE_GAP, delta >> 16);
+	
+	append(delta & 0xFFFF, kind, value);
+}
+
+
+const TraceRecord &
+Trace::get(int n)
+{
+	return records[(head + n) % LENGTH];
+}
+
+
+void
+Trace::append(uint16_t time, uint8_t kind, uint16_t value)
+{
+	if (!recording)
+		return;
+	
+	if (count == LENGTH) {
+		if (!wrap) {
+			// Full, stop here
+			recording = false;
+			return;
+		}
+		
+		// Drop the oldest record
+		head = (head + 1) % LENGTH;
+		count--;
+	}
+	
+	TraceRecord &r = records[(head + count) % LENGTH];
+	r.time  = time;
+	r.kind  = kind;
+	r.value = value;
+	count++;
+}
@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <WProgram.h>
+
+
+/* A trace is a sequence of timestamped input records which can be replayed
+ * against the sketch to reproduce real-world input timing. Each record holds:
+ *
+ *   time  - Milliseconds since the previous record
+ *   kind  - Record type in the top two bits, channel/call ID in the bottom six
+ *   value - Analog reading, port snapshot or call argument
+ *
+ * Gaps longer than 65535ms are preceded by a TRACE_GAP record whose value
+ * holds the upper 16 bits of the gap.
+ */
+
+enum TraceKind {
+	TRACE_GAP    = 0x00,
+	TRACE_ANALOG = 0x40,
+	TRACE_PORT   = 0x80,
+	TRACE_CALL   = 0xC0,
+};
+
+
+struct TraceRecord {
+	uint16_t time;
+	uint8_t  kind;
+	uint16_t value;
+};
+
+
+class Trace {
+	public:
+		static const int LENGTH = 32;
+		
+		Trace();
+		
+		// Start recording, discarding any existing records. If wrap is set the
+		// oldest records are overwritten when full, otherwise recording stops.
+		void start(bool wrap);
+		void stop();
+		
+		bool is_recording();
+		
+		// Add a record of the given kind (including channel/ID)
+		void record(uint8_t kind, uint16_t value);
+		
+		// Number of records held
+		int length();
+		
+		// Get the nth oldest record
+		const TraceRecord &get(int n);
+	
+	private:
+		TraceRecord records[LENGTH];
+		
+		uint8_t head;  // Index of the oldest record
+		uint8_t count; // Number of records held
+		
+		bool recording;
+		bool wrap;
+		
+		unsigned long last_time;
+		
+		void append(uint16_t time, uint8_t kind, uint16_t value);
+};
+
+
+#endif
@@ -0,0 +1,133 @@
+#include <WProgram.h>
+#include "Washing.h"
+
+
+WashingMonitor::WashingMonitor(int threshold, unsigned long gap, unsigned long min_duration)
+	: wash_level(128)
+	, spin_deviation(64)
+	, threshold(threshold)
+	, gap(gap)
+	, min_duration(min_duration)
+	, average(0)
+	, deviation(0)
+	, phase(PHASE_IDLE)
+	, cycle_start(0)
+	, last_active(0)
+	, last_sample(0)
+	, pauses(0)
+	, peak(0)
+	, history_head(0)
+	, history_count(0)
+{
+	// Do nothing
+}
+
+
+WashingMonitor::Event
+WashingMonitor::update(int level, unsigned long now)
+{
+	unsigned long delta = now - last_sample;
+	last_sample = now;
+	
+	int activity = threshold - level;
+	bool active = activity > 0;
+	if (!active)
+		activity = 0;
+	
+	// Smooth the activity and how much it is varying
+	average += ((activity * 16) - average) / 8;
+	deviation += (abs((activity * 16) - average) - deviation) / 8;
+	
+	if (phase == PHASE_IDLE) {
+		if (!active)
+			return EVENT_NONE;
+		
+		// A new cycle has started
+		for (int i = 0; i < NUM_PHASES; i++)
+			phase_time[i] = 0;
+		pauses = 0;
+		peak = activity;
+		cycle_start = last_active = now;
+		phase = classify();
+		return EVENT_STARTED;
+	}
+	
+	phase_time[phase] += delta;
+	
+	if (active) {
+		last_active = now;
+		if (activity > peak)
+			peak = activity;
+		phase = classify();
+	} else {
+		if (phase != PHASE_PAUSE) {
+			phase = PHASE_PAUSE;
+			pauses++;
+		}
+		
+		// Paused for too long, the cycle is over
+		if (now - last_active > gap)
+			return finish() ? EVENT_FINISHED : EVENT_NONE;
+	}
+	
+	return EVENT_NONE;
+}
+
+
+WashingMonitor::Phase
+WashingMonitor::classify()
+{
+	if (deviation >= spin_deviation * 16)
+		return PHASE_SPIN;
+	else if (average < wash_level * 16)
+		return PHASE_FILL;
+	else
+		return PHASE_WASH;
+}
+
+
+bool
+WashingMonitor::finish()
+{
+	phase = PHASE_IDLE;
+	
+	// The final pause isn't part of the cycle
+	unsigned long trailing = last_sample - last_active;
+	phase_time[PHASE_PAUSE] -= min(trailing, phase_time[PHASE_PAUSE]);
+	pauses--;
+	
+	unsigned long duration = last_active - cycle_start;
+	if (duration < min_duration)
+		return false;
+	
+	history_head = (history_head + 1) % HISTORY_LENGTH;
+	if (history_count < HISTORY_LENGTH)
+		history_count++;
+	
+	Cycle &cycle = history[history_head];
+	cycle.duration = duration / 1000ul;
+	for (int i = 0; i < NUM_PHASES; i++)
+		cycle.phase_time[i] = phase_time[i] / 1000ul;
+	cycle.pauses = pauses;
+	cycle.peak = peak / 4;
+	
+	return true;
+}
+
+
+WashingMonitor::Phase WashingMonitor::get_phase() { return phase; }
+int WashingMonitor::get_history_length() { return history_count; }
+
+
+unsigned long
+WashingMonitor::get_run_time(unsigned long now)
+{
+	return (phase == PHASE_IDLE) ? 0 : now - cycle_start;
+}
+
+
+const WashingMonitor::Cycle &
+WashingMonitor::get_cycle(int n)
+{
+	return history[(history_head + HISTORY_LENGTH - n) % HISTORY_LENGTH];
+}
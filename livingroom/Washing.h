@@ -0,0 +1,92 @@
+#ifndef WASHING_H
+#define WASHING_H
+
+#include <WProgram.h>
+
+
+/* Follows a washing machine through its cycle from an analog sensor which
+ * reads below a threshold while the machine is running. The distance below
+ * the threshold (activity) is smoothed and used to classify the phase of the
+ * cycle. Pauses shorter than the gap are bridged so that they don't end the
+ * cycle. A summary of the last few cycles is kept.
+ */
+class WashingMonitor {
+	public:
+		enum Phase {
+			PHASE_FILL = 0,
+			PHASE_WASH,
+			PHASE_SPIN,
+			PHASE_PAUSE,
+			NUM_PHASES,
+			PHASE_IDLE = NUM_PHASES,
+		};
+		
+		enum Event {
+			EVENT_NONE = 0,
+			EVENT_STARTED,
+			EVENT_FINISHED,
+		};
+		
+		// Summary of a completed cycle, times in seconds
+		struct Cycle {
+			uint16_t duration;
+			uint16_t phase_time[NUM_PHASES];
+			uint8_t  pauses;
+			uint8_t  peak; // Peak activity / 4
+		};
+		
+		static const int HISTORY_LENGTH = 4;
+		
+		// Gap and minimum cycle duration in milliseconds
+		WashingMonitor(int threshold, unsigned long gap, unsigned long min_duration);
+		
+		// Add a sample, returns any event it caused
+		Event update(int level, unsigned long now);
+		
+		Phase get_phase();
+		
+		// Time since the current cycle started (ms), zero if idle
+		unsigned long get_run_time(unsigned long now);
+		
+		// Get the nth most recent completed cycle
+		int get_history_length();
+		const Cycle &get_cycle(int n);
+		
+		// Smoothed activity below which the machine is filling
+		int wash_level;
+		
+		// Smoothed variation in activity above which the machine is spinning
+		int spin_deviation;
+	
+	private:
+		int threshold;
+		unsigned long gap;
+		unsigned long min_duration;
+		
+		// Smoothed activity and its variation (scaled by 16)
+		int average;
+		int deviation;
+		
+		Phase phase;
+		
+		unsigned long cycle_start;
+		unsigned long last_active;
+		unsigned long last_sample;
+		
+		// Statistics for the current cycle
+		unsigned long phase_time[NUM_PHASES];
+		uint8_t pauses;
+		int peak;
+		
+		Cycle history[HISTORY_LENGTH];
+		uint8_t history_head; // Index of the most recent cycle
+		uint8_t history_count;
+		
+		Phase classify();
+		
+		// End the cycle, returns true if it was long enough to count
+		bool finish();
+};
+
+
+#endif
@@ -0,0 +1,132 @@
+#include <WProgram.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <math.h>
+#include "WaveCapture.h"
+
+
+WaveCapture *volatile WaveCapture::active = NULL;
+
+
+ISR(ADC_vect)
+{
+	if (WaveCapture::active)
+		WaveCapture::active->sample(ADCH);
+}
+
+
+WaveCapture::WaveCapture()
+	: mean(0)
+	, rms(0)
+	, peak(0)
+	, band(0)
+	, count(0)
+	, divider(1)
+	, skipped(0)
+	, bin(0)
+	, running(false)
+	, analysed(true)
+{
+	// Do nothing
+}
+
+
+bool
+WaveCapture::start(uint8_t channel, uint8_t divider, uint8_t bin)
+{
+	if (running || active)
+		return false;
+	
+	this->divider = divider ? divider : 1;
+	this->bin = bin;
+	count = 0;
+	skipped = 0;
+	analysed = false;
+	running = true;
+	active = this;
+	
+	// Left-adjusted so only ADCH needs reading, AVcc reference
+	ADMUX = _BV(REFS0) | _BV(ADLAR) | (channel & 0x07);
+	
+	// Free running, interrupt on each conversion, ADC clock = 16MHz/128
+	ADCSRB = 0;
+	ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF)
+	       | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+	
+	return true;
+}
+
+
+void
+WaveCapture::sample(uint8_t value)
+{
+	if (++skipped < divider)
+		return;
+	skipped = 0;
+	
+	buffer[count++] = value;
+	if (count == LENGTH)
+		stop();
+}
+
+
+void
+WaveCapture::stop()
+{
+	// Back to single conversions as analogRead() expects
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+	ADMUX = _BV(REFS0);
+	
+	running = false;
+	active = NULL;
+}
+
+
+bool WaveCapture::is_running() { return running; }
+uint8_t WaveCapture::get_sample(int n) { return buffer[n]; }
+unsigned int WaveCapture::get_sample_rate() { return ADC_RATE / divider; }
+
+
+bool
+WaveCapture::refresh()
+{
+	if (running || analysed)
+		return false;
+	
+	analyse();
+	analysed = true;
+	return true;
+}
+
+
+void
+WaveCapture::analyse()
+{
+	// Mean
+	unsigned int sum = 0;
+	for (int i = 0; i < LENGTH; i++)
+		sum += buffer[i];
+	mean = sum / LENGTH;
+	
+	// RMS and peak about the mean
+	unsigned long sum_sq = 0;
+	peak = 0;
+	for (int i = 0; i < LENGTH; i++) {
+		int v = buffer[i] - mean;
+		sum_sq += (long)v * v;
+		if (abs(v) > peak)
+			peak = abs(v);
+	}
+	rms = sqrt(sum_sq / LENGTH);
+	
+	// Goertzel filter for the amplitude in the chosen bin
+	float coeff = 2.0 * cos(2.0 * M_PI * bin / LENGTH);
+	float s1 = 0, s2 = 0;
+	for (int i = 0; i < LENGTH; i++) {
+		float s0 = (buffer[i] - mean) + coeff * s1 - s2;
+		s2 = s1;
+		s1 = s0;
+	}
+	float power = s1*s1 + s2*s2 - coeff*s1*s2;
+	band = sqrt(power) * 2 / LENGTH;
+}
@@ -0,0 +1,66 @@
+#ifndef WAVECAPTURE_H
+#define WAVECAPTURE_H
+
+#include <WProgram.h>
+
+
+/* Captures a block of samples from one analog channel with the ADC free
+ * running and interrupt driven, so the main loop carries on while the block
+ * fills. Once full the block is analysed for its mean, RMS and peak (about
+ * the mean) and the amplitude in one frequency bin. Nothing else may use the
+ * ADC while a capture is running.
+ */
+class WaveCapture {
+	public:
+		static const int LENGTH = 128;
+		
+		// Free-running conversion rate with the ADC clock at 125kHz
+		static const unsigned int ADC_RATE = 9615;
+		
+		WaveCapture();
+		
+		// Start capturing every divider'th conversion from the channel,
+		// measuring the amplitude of the given bin (cycles per block). Returns
+		// false if a capture is already running.
+		bool start(uint8_t channel, uint8_t divider, uint8_t bin);
+		
+		bool is_running();
+		
+		// Analyse a completed block, returns true once when it is ready
+		bool refresh();
+		
+		// Samples of the last block (8-bit)
+		uint8_t get_sample(int n);
+		
+		unsigned int get_sample_rate();
+		
+		// Results of the last analysis
+		int mean;
+		int rms;
+		int peak;
+		int band;
+		
+		// Called from the ADC interrupt with each conversion
+		void sample(uint8_t value);
+		
+		// The capture receiving conversions
+		static WaveCapture *volatile active;
+	
+	private:
+		uint8_t buffer[LENGTH];
+		volatile uint8_t count;
+		
+		uint8_t divider;
+		volatile uint8_t skipped;
+		
+		uint8_t bin;
+		
+		volatile bool running;
+		bool analysed;
+		
+		void stop();
+		void analyse();
+};
+
+
+#endif
@@ -1,8 +1,16 @@
 #include <WProgram.h>
-#include <Servo.h>
 #include <RGBLED.h>
+#include <ServoPulse.h>
 #include <Lighting.h>
 #include <Buttons.h>
+#include <Trace.h>
+#include <Notifier.h>
+#include <LEDChannels.h>
+#include <Occupancy.h>
+#include <Washing.h>
+#include <AnalogWatch.h>
+#include <WaveCapture.h>
+#include <Tick.h>
 
 #include "pins.h"
 #include "comms.h"
@@ -10,6 +18,27 @@
 #include "Wire.h"
 #include "i2c_expander.h"
 
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+
+/******************************************************************************
+ * Build Options                                                              *
+ ******************************************************************************/
+
+// Sleep the MCU between scheduled work (claims the pin-change interrupts)
+#define LOW_POWER_IDLE 0
+
+// Keep a trace of inputs which can be read back over SHET for replay
+#define TRACE_CAPTURE 0
+
+// Reset on a stalled task (needs a bootloader which survives a watchdog reset)
+#define WATCHDOG 0
+
 
 /******************************************************************************
  * Pin Assignments                                                            *
@@ -31,6 +60,9 @@ static const int PIN_RGBLED_B            = 6;
 
 static const int PIN_IO_INTERRUPT        = 12;
 
+static const int PIN_ACCENT_LED          = 11;
+static const int PIN_STATUS_LED          = RC3;
+
 static const int PIN_BTN[]               = {RC6,RC7,RB0,RB1,RB2,
                                                 RC0,RC1,RC2    };
 static const int NUM_BTNS                = 8;
@@ -39,6 +71,10 @@ static const int APIN_WASHING            = 0;
 static const int APIN_OVEN               = 1;
 static const int APIN_PIR                = 2;
 
+// Light level sensors showing whether each light is really on (-1 for none)
+static const int APIN_LIGHT_KITCHEN      = -1;
+static const int APIN_LIGHT_LOUNGE       = -1;
+
 static const int PIN_AMP_A               = RB5;
 static const int PIN_AMP_B               = RB6;
 
@@ -52,13 +88,24 @@ static char *SHETSOURCE_PATH             = "lounge/arduino";
 static char *LIGHT_KITCHEN_NAME          = "light_kitchen";
 static char *LIGHT_LOUNGE_NAME           = "light_lounge";
 static char *LIGHT_TOGGLE_NAME           = "light_toggle";
+static char *LIGHT_DRIFT_NAME            = "light_drift";
 
 static char *RGBLED_SET_INSTANT_NAME     = "set_rgbled_instant";
 static char *RGBLED_SET_FAST_NAME        = "set_rgbled";
+static char *RGBLED_SET_RG_NAME          = "set_rgbled_rg";
+static char *RGBLED_SET_CMD_NAME         = "set_rgbled_cmd";
+static char *RGBLED_SET_PALETTE_NAME     = "set_rgbled_palette";
+static char *RGBLED_SET_ALERT_NAME       = "set_rgbled_alert";
+static char *RGBLED_CLEAR_ALERT_NAME     = "clear_rgbled_alert";
+
+static char *LED_CHANNEL_SET_NAME        = "set_led_channel";
+static char *LED_CHANNEL_GET_NAME        = "get_led_channel";
 
 static char *WASHING_FINISHED_NAME       = "washing_finished";
 static char *WASHING_STARTED_NAME        = "washing_started";
 static char *WASHING_STATE_NAME          = "get_washing_state";
+static char *WASHING_PHASE_NAME          = "get_washing_phase";
+static char *WASHING_HISTORY_NAME        = "get_washing_history";
 
 static char *BTNS_ON_PRESS_NAME          = "btn_pressed";
 static char *BTNS_ON_MODE_CHANGE_NAME    = "btn_mode_changed";
@@ -66,7 +113,20 @@ static char *BTNS_MODE                   = "btn_mode";
 
 static char *LIGHTSWITCH_PRESSED_NAME    = "btn_lightswitch";
 
+static char *ANALOG_WATCH_NAME           = "analog_watch";
+static char *ANALOG_READ_NAME            = "analog_read";
+static char *ANALOG_CHANGED_NAME         = "analog_changed";
+static char *ANALOG_CROSSED_NAME         = "analog_crossed";
+static char *CAPTURE_START_NAME          = "capture_start";
+static char *CAPTURE_READ_NAME           = "capture_read";
+static char *CAPTURE_RESULT_NAME         = "capture_result";
+static char *CAPTURE_DONE_NAME           = "capture_done";
+
 static char *PIR_NAME                    = "pir";
+static char *OCCUPANCY_CHANGED_NAME      = "occupancy_changed";
+static char *OCCUPIED_NAME               = "occupied";
+static char *MOTION_LEVEL_NAME           = "get_motion_level";
+static char *OCCUPANCY_TIMEOUT_NAME      = "occupancy_timeout";
 
 static char *OVEN_ON_NAME                = "on_oven_on";
 static char *OVEN_OFF_NAME               = "on_oven_off";
@@ -78,6 +138,45 @@ static char *BACKDOOR_CLOSED_NAME        = "backdoor_closed";
 
 static char *AMP_INC_NAME                = "amp_inc";
 static char *AMP_DEC_NAME                = "amp_dec";
+static char *AMP_VOLUME_NAME             = "amp_volume";
+static char *AMP_HOME_NAME               = "amp_home";
+
+static char *BOOT_TIME_NAME              = "get_boot_time";
+
+#if WATCHDOG
+static char *LAST_STALL_NAME             = "get_last_stall";
+#endif
+
+static char *CONFIG_FIELD_NAME           = "config_field";
+static char *CONFIG_VALUE_NAME           = "config_value";
+static char *CONFIG_SAVE_NAME            = "config_save";
+static char *CONFIG_DEFAULTS_NAME        = "config_defaults";
+
+static char *SHET_STATS_NAME             = "get_shet_stats";
+static char *SHET_STATS_RESET_NAME       = "reset_shet_stats";
+
+static char *CLOCK_NOW_NAME              = "clock_now";
+static char *EVENT_STAMPS_NAME           = "event_stamps";
+static char *EVENT_STAMP_NAME            = "event_stamp";
+static char *EVENT_LATENCY_NAME          = "get_event_latency";
+static char *EVENT_LATENCY_RESET_NAME    = "reset_event_latency";
+
+static char *MEMORY_NAME                 = "get_memory";
+static char *OBJECT_SIZE_NAME            = "get_object_size";
+
+#if LOW_POWER_IDLE
+static char *IDLE_DUTY_NAME              = "get_idle_duty";
+static char *IDLE_LATENCY_NAME           = "get_idle_latency";
+#endif
+
+#if TRACE_CAPTURE
+static char *TRACE_START_NAME            = "trace_start";
+static char *TRACE_LENGTH_NAME           = "trace_length";
+static char *TRACE_READ_NAME             = "trace_read";
+#endif
+
+static char *PROPS_CHANGED_NAME          = "props_changed";
+static char *PUSH_INTERVAL_NAME          = "push_interval";
 
 /******************************************************************************
  * Constant Values                                                            *
@@ -85,17 +184,48 @@ static char *AMP_DEC_NAME                = "amp_dec";
 
 static const int IO_EXPANDER_ADDRESS     = 2;
 
+// Bring SHET up first and home the servos/configure the expander afterwards
+static const bool STAGED_INIT            = true;
+
 static const int BTN_LOOP_PERIOD         = 100;
 static const int SLOW_LOOP_PERIOD        = 1000;
 
+// Time (us) each pass may spend servicing SHET messages, 0 for one DoSHET()
+static const int SHET_BUDGET             = 1000;
+
+// Loop periods (ms) used instead of the above when idling in low-power mode
+static const unsigned long BTN_LOOP_INTERVAL  = 20;
+static const unsigned long SLOW_LOOP_INTERVAL = 200;
+
+// Longest time (ms) each watchdog task may go without checking in
+static const unsigned int TASK_TIMEOUTS[] = {1000, 1000, 2000, 3000};
+
 static const int RGBLED_FADE_FAST        = 250;
 
+// Fade durations (ms) selectable by packed colour commands
+static const int RGBLED_DURATIONS[16]    = {    0,   50,  100,  150,
+                                              250,  400,  500,  750,
+                                             1000, 1500, 2000, 3000,
+                                             5000,10000,20000,30000};
+
+static const int RGBLED_PALETTE_SIZE     = 16;
+
 static const int OVEN_STATE_THRESHOLD    = 512;
 
 static const int PIR_THRESHOLD           = 712;
+static const bool PIR_RAW_EVENTS         = false; // Fire "pir" on every trigger
+static const unsigned long PIR_WINDOW    = 60000;
+static const unsigned long OCCUPANCY_TIMEOUT = 300000;
 
 static const int WASHING_STATE_THRESHOLD = 512;
 static const unsigned long WASHING_MIN   = 5;
+static const unsigned long WASHING_GAP   = 180000; // Longest pause in a cycle
+static const int WASHING_WASH_LEVEL      = 128;
+static const int WASHING_SPIN_DEVIATION  = 64;
+
+// Smallest change in an analog reading recorded in a trace (threshold
+// crossings are always recorded)
+static const int TRACE_ANALOG_DEADBAND   = 16;
 
 static const int SERVO_KITCHEN_ON        = 60;
 static const int SERVO_KITCHEN_IDLE      = 90;
@@ -105,8 +235,18 @@ static const int SERVO_LOUNGE_ON         = 65;
 static const int SERVO_LOUNGE_IDLE       = 90;
 static const int SERVO_LOUNGE_OFF        = 115;
 
+// Keep pulsing the light servos at idle rather than releasing them (1), for
+// switches which creep back without the servo resting against them
+static const int SERVO_HOLD              = 0;
+
 static const unsigned long LONG_PRESS    = 750;
 
+// Light level above which a sensed light is on
+static const int LIGHT_THRESHOLD         = 300;
+
+// How long (ms) a light must disagree with its sensor before it is believed
+static const unsigned long LIGHT_SETTLE_TIME = 2000;
+
 static const uint8_t NUM_MODES           = 5;
 
 static const uint8_t NUM_BTN_NORM        = 5;
@@ -118,6 +258,9 @@ static const uint8_t BTN_MODE_MASKS[]    = {0x20, 0x80};
 static const uint8_t NUM_BTN_MOD         = 1;
 static const uint8_t BTN_MOD_MASKS[]     = {0x40};
 
+// Bits needed to hold a mode number (< NUM_MODES) and mode button type
+static const uint8_t BTN_MODE_BITS       = 3 + NUM_BTN_MODE;
+
 static const int MODE_COLOURS[1<<NUM_BTN_MODE][NUM_BTN_NORM][3]
                                          = {{{  0,  0,  0},  // Ignored
                                              {  0,  0,  0},  // Ignored
@@ -138,6 +281,22 @@ static const int MODE_COLOURS[1<<NUM_BTN_MODE][NUM_BTN_NORM][3]
 
 static const int LIGHTSWITCH_THRESHOLD   = 200;
 
+static const int NUM_APINS               = 6;
+
+// Amplifier volume steps from minimum to maximum
+static const int AMP_MAX_VOLUME          = 64;
+static const int AMP_HOME_STEPS          = AMP_MAX_VOLUME + 8;
+
+
+
+/******************************************************************************
+ * Timekeeping                                                                *
+ ******************************************************************************/
+
+// The time at the start of the current pass of loop(), refresh functions use
+// this rather than reading the clock themselves.
+Tick tick;
+
 
 
 /******************************************************************************
@@ -159,521 +318,2383 @@ shetsource_init()
 
 
 /******************************************************************************
- * I/O Expander Board Boiler-Plate                                            *
+ * Configuration                                                              *
  ******************************************************************************/
 
-io_expander expander;
-
-void
-io_init(void)
+// Settings which can be tuned at runtime and saved to EEPROM. The constants
+// above are the defaults. Every field is an int so fields can be addressed by
+// number (ConfigField).
+struct Config {
+	int btn_loop_period;
+	int slow_loop_period;
+	int btn_loop_interval;
+	int slow_loop_interval;
+	int long_press;
+	int pir_threshold;
+	int oven_threshold;
+	int rgbled_fade_fast;
+	int servo_kitchen_on;
+	int servo_kitchen_idle;
+	int servo_kitchen_off;
+	int servo_lounge_on;
+	int servo_lounge_idle;
+	int servo_lounge_off;
+	int shet_budget;
+	int light_threshold;
+	int servo_hold;
+};
+
+enum ConfigField {
+	CONFIG_BTN_LOOP_PERIOD = 0,
+	CONFIG_SLOW_LOOP_PERIOD,
+	CONFIG_BTN_LOOP_INTERVAL,
+	CONFIG_SLOW_LOOP_INTERVAL,
+	CONFIG_LONG_PRESS,
+	CONFIG_PIR_THRESHOLD,
+	CONFIG_OVEN_THRESHOLD,
+	CONFIG_RGBLED_FADE_FAST,
+	CONFIG_SERVO_KITCHEN_ON,
+	CONFIG_SERVO_KITCHEN_IDLE,
+	CONFIG_SERVO_KITCHEN_OFF,
+	CONFIG_SERVO_LOUNGE_ON,
+	CONFIG_SERVO_LOUNGE_IDLE,
+	CONFIG_SERVO_LOUNGE_OFF,
+	CONFIG_SHET_BUDGET,
+	CONFIG_LIGHT_THRESHOLD,
+	CONFIG_SERVO_HOLD,
+	
+	NUM_CONFIG_FIELDS
+};
+
+static const Config CONFIG_DEFAULTS = {BTN_LOOP_PERIOD,
+                                       SLOW_LOOP_PERIOD,
+                                       BTN_LOOP_INTERVAL,
+                                       SLOW_LOOP_INTERVAL,
+                                       LONG_PRESS,
+                                       PIR_THRESHOLD,
+                                       OVEN_STATE_THRESHOLD,
+                                       RGBLED_FADE_FAST,
+                                       SERVO_KITCHEN_ON,
+                                       SERVO_KITCHEN_IDLE,
+                                       SERVO_KITCHEN_OFF,
+                                       SERVO_LOUNGE_ON,
+                                       SERVO_LOUNGE_IDLE,
+                                       SERVO_LOUNGE_OFF,
+                                       SHET_BUDGET,
+                                       LIGHT_THRESHOLD,
+                                       SERVO_HOLD};
+
+// Allowed range of each field
+static const int CONFIG_LIMITS[NUM_CONFIG_FIELDS][2] = {{1, 10000},
+                                                        {1, 30000},
+                                                        {1,  1000},
+                                                        {1, 10000},
+                                                        {50, 10000},
+                                                        {0,  1023},
+                                                        {0,  1023},
+                                                        {0, 10000},
+                                                        {0,   180},
+                                                        {0,   180},
+                                                        {0,   180},
+                                                        {0,   180},
+                                                        {0,   180},
+                                                        {0,   180},
+                                                        {0, 10000},
+                                                        {0,  1023},
+                                                        {0,     1}};
+
+// Bump when the layout of Config changes to discard old saved settings
+static const uint8_t CONFIG_VERSION = 4;
+
+// Saved as the version, size, settings then a CRC of all of these
+static uint8_t *const CONFIG_ADDRESS = (uint8_t *)0;
+
+Config config = CONFIG_DEFAULTS;
+
+// The field config_value reads and writes
+int config_field = 0;
+
+
+// Pass the settings on to the objects which keep their own copy (defined
+// after them below), only needed when the settings change
+void config_apply();
+
+
+uint8_t
+config_crc(const Config &c)
 {
-	Wire.begin();
-	pinMode(PIN_IO_INTERRUPT, INPUT);
-	digitalWrite(PIN_IO_INTERRUPT, LOW);
-	init_io_expander(&expander, IO_EXPANDER_ADDRESS);
+	uint8_t crc = 0;
+	crc = _crc_ibutton_update(crc, CONFIG_VERSION);
+	crc = _crc_ibutton_update(crc, sizeof(Config));
+	for (unsigned int i = 0; i < sizeof(Config); i++)
+		crc = _crc_ibutton_update(crc, ((const uint8_t *)&c)[i]);
+	return crc;
 }
 
 
+// Load the saved settings, returns false (leaving the defaults) if there are
+// none or they don't match this build
+bool
+config_load()
+{
+	if (eeprom_read_byte(CONFIG_ADDRESS) != CONFIG_VERSION
+	    || eeprom_read_byte(CONFIG_ADDRESS + 1) != sizeof(Config))
+		return false;
+	
+	Config saved;
+	eeprom_read_block(&saved, CONFIG_ADDRESS + 2, sizeof(Config));
+	if (eeprom_read_byte(CONFIG_ADDRESS + 2 + sizeof(Config)) != config_crc(saved))
+		return false;
+	
+	config = saved;
+	config_apply();
+	return true;
+}
 
-/******************************************************************************
- * Lights                                                                     *
- ******************************************************************************/
-
-Lighting light_kitchen = Lighting(PIN_SERVO_KITCHEN,
-                                  SERVO_KITCHEN_OFF,
-                                  SERVO_KITCHEN_IDLE,
-                                  SERVO_KITCHEN_ON);
-
-Lighting light_lounge  = Lighting(PIN_SERVO_LOUNGE,
-                                  SERVO_LOUNGE_OFF,
-                                  SERVO_LOUNGE_IDLE,
-                                  SERVO_LOUNGE_ON);
-
-bool light_kitchen_requested, light_kitchen_state;
-bool light_lounge_requested,  light_lounge_state;
-
-SHETSource::LocalEvent *lightswitch_pressed;
-
-
-// Setters
-void set_light_kitchen(int s) { light_kitchen_requested = true; light_kitchen_state = s; }
-void set_light_lounge(int s)  { light_lounge_requested = true;  light_lounge_state = s; }
-
-// Getters
-int get_light_kitchen() { return light_kitchen.get(); }
-int get_light_lounge()  { return light_lounge.get(); }
 
 void
-lights_toggle()
+config_save()
 {
-	light_kitchen_requested = light_lounge_requested = true;
-	light_kitchen_state = light_lounge_state
-		= !(light_lounge.get() && light_kitchen.get());
+	eeprom_update_byte(CONFIG_ADDRESS, CONFIG_VERSION);
+	eeprom_update_byte(CONFIG_ADDRESS + 1, sizeof(Config));
+	eeprom_update_block(&config, CONFIG_ADDRESS + 2, sizeof(Config));
+	eeprom_update_byte(CONFIG_ADDRESS + 2 + sizeof(Config), config_crc(config));
 }
 
 
+// Go back to the defaults (until saved, the EEPROM is left alone)
 void
-lights_init()
+config_defaults()
 {
-	// Setup lightswitch
-	//pinMode(APIN_LIGHTSWITCH, INPUT);
-	//digitalWrite(APIN_LIGHTSWITCH, LOW);
-	
-	// Add SHET properties
-	shetsource.AddProperty(LIGHT_KITCHEN_NAME, set_light_kitchen, get_light_kitchen);
-	shetsource.AddProperty(LIGHT_LOUNGE_NAME,  set_light_lounge,  get_light_lounge);
-	
-	shetsource.AddAction(LIGHT_TOGGLE_NAME, lights_toggle);
-	
-	// Move servos to rest position
-	light_kitchen.init();
-	light_lounge.init();
+	config = CONFIG_DEFAULTS;
+	config_apply();
 }
 
 
+// Getter/setter for the field selected by config_field, out of range values
+// are ignored
 void
-lights_refresh()
+set_config_value(int value)
 {
-	//int pin = analogRead(APIN_LIGHTSWITCH);
-	//bool new_btn_state = pin < LIGHTSWITCH_THRESHOLD;
-	//bool new_pir_state = (pin > LIGHTSWITCH_THRESHOLD) && (pin < PIR_THRESHOLD);
-	
-	// TODO: Rewrite with button library
-	// Handle button
-	//static bool btn_state = false;
-	//if (new_btn_state != btn_state && new_btn_state == true)
-	//	(*lightswitch_pressed)();
-	//btn_state = new_btn_state;
-	
-	// Refresh servos
-	light_kitchen.refresh();
-	light_lounge.refresh();
-	
-	// Disalow simultaneous changes
-	if (light_kitchen_requested && !light_lounge.is_busy()) {
-		light_kitchen.set(light_kitchen_state);
-		light_kitchen_requested = false;
-	}
-	if (light_lounge_requested && !light_kitchen.is_busy()) {
-		light_lounge.set(light_lounge_state);
-		light_lounge_requested = false;
-	}
+	if (config_field < 0 || config_field >= NUM_CONFIG_FIELDS)
+		return;
+	if (value < CONFIG_LIMITS[config_field][0] || value > CONFIG_LIMITS[config_field][1])
+		return;
+	((int *)&config)[config_field] = value;
+	config_apply();
 }
 
 
-
-
-/******************************************************************************
- * PIR                                                                        *
- ******************************************************************************/
-
-// Lounge PIR event
-SHETSource::LocalEvent *pir;
-
-void
-pir_init(void)
+int
+get_config_value()
 {
-	pir = shetsource.AddEvent(PIR_NAME);
+	if (config_field < 0 || config_field >= NUM_CONFIG_FIELDS)
+		return -1;
+	return ((int *)&config)[config_field];
 }
 
 
 void
-pir_refresh(void)
+config_init()
 {
-	static bool pir_state = false;
-	bool new_pir_state = analogRead(APIN_PIR) < PIR_THRESHOLD;
+	if (!config_load())
+		config_apply();
 	
-	// Handle PIR
-	if (new_pir_state != pir_state && new_pir_state == true)
-		(*pir)();
-	pir_state = new_pir_state;
+	shetsource.AddProperty(CONFIG_FIELD_NAME, &config_field);
+	shetsource.AddProperty(CONFIG_VALUE_NAME, set_config_value, get_config_value);
+	shetsource.AddAction(CONFIG_SAVE_NAME, config_save);
+	shetsource.AddAction(CONFIG_DEFAULTS_NAME, config_defaults);
 }
 
 
 
 /******************************************************************************
- * rgb led                                                                    *
+ * Input Tracing                                                              *
  ******************************************************************************/
 
-RGBLED rgbled = RGBLED(PIN_RGBLED_R, PIN_RGBLED_G, PIN_RGBLED_B);
-
-// Colour Decoder
+// IDs of the incoming SHET calls which change the node's state. These are
+// stored in traces so never renumber them, only add new ones at the end.
+enum ShetCall {
+	CALL_LIGHT_KITCHEN  = 0,
+	CALL_LIGHT_LOUNGE   = 1,
+	CALL_LIGHT_TOGGLE   = 2,
+	CALL_RGBLED_INSTANT = 3,
+	CALL_RGBLED_FAST    = 4,
+	CALL_BTN_MODE       = 5,
+	CALL_AMP_INC        = 6,
+	CALL_AMP_DEC        = 7,
+	CALL_RGBLED_RG      = 8,
+	CALL_RGBLED_CMD     = 9,
+	CALL_RGBLED_PALETTE = 10,
+	CALL_RGBLED_ALERT   = 11,
+	CALL_LED_CHANNEL    = 12,
+	CALL_ANALOG_WATCH   = 13,
+	CALL_CAPTURE_START  = 14,
+	CALL_AMP_VOLUME     = 15,
+	CALL_AMP_HOME       = 16,
+};
+
+// IDs of the digital inputs snapshotted
+enum TracePort {
+	PORT_BTNS = 0,
+	PORT_LIGHTSWITCH,
+	PORT_BACKDOOR,
+	NUM_TRACE_PORTS
+};
+
+
+#if TRACE_CAPTURE
+
+Trace trace;
+
+// The last values recorded for each input
+int trace_analog[NUM_APINS];
+int trace_port[NUM_TRACE_PORTS];
+
+
+// Start a trace: 0 stops, 1 records until full, 2 keeps the latest records
 void
-set_rgbled_colour(int encoded, int duration)
+trace_start(int mode)
 {
-	// Expand 15-bit colour into 24-bit colour
-	Colour colour;
-	colour.r = ((encoded >>  0) & 0x1F) << 3;
-	colour.g = ((encoded >>  5) & 0x1F) << 3;
-	colour.b = ((encoded >> 10) & 0x1F) << 3;
-	rgbled.set_colour(colour, duration);
+	if (mode == 0) {
+		trace.stop();
+		return;
+	}
+	
+	// Make sure the first reading of everything is recorded
+	for (int i = 0; i < NUM_APINS; i++)
+		trace_analog[i] = -1;
+	for (int i = 0; i < NUM_TRACE_PORTS; i++)
+		trace_port[i] = -1;
+	
+	trace.start(mode == 2);
 }
 
-void
-set_rgbled_colour(int r, int g, int b, int duration)
+
+// The threshold an analog reading is compared against (-1 for none)
+int
+trace_threshold(int apin)
 {
-	Colour colour;
-	colour.r = r;
-	colour.g = g;
-	colour.b = b;
-	rgbled.set_colour(colour, duration);
+	switch (apin) {
+		case APIN_PIR:     return config.pir_threshold;
+		case APIN_OVEN:    return config.oven_threshold;
+		case APIN_WASHING: return WASHING_STATE_THRESHOLD;
+		default:           return -1;
+	}
 }
 
 
-// Setters
-void set_rgbled_colour_instant(int encoded) { set_rgbled_colour(encoded, 0); }
-void set_rgbled_colour_fast(int encoded) { set_rgbled_colour(encoded, RGBLED_FADE_FAST); }
-
-
-void
-rgbled_init()
+// Which side of a threshold a reading is on (0 when equal, as the sensors
+// compare with both < and >)
+int
+trace_side(int value, int threshold)
 {
-	// Set up pins
-	rgbled.attach();
-	rgbled.refresh(true);
-	
-	// Add SHET actions
-	shetsource.AddAction(RGBLED_SET_INSTANT_NAME, set_rgbled_colour_instant);
-	shetsource.AddAction(RGBLED_SET_FAST_NAME, set_rgbled_colour_fast);
+	return (value > threshold) - (value < threshold);
 }
 
 
-// Call an update on the LED (for fading etc).
-void rgbled_refresh() { rgbled.refresh(true); }
+int
+trace_length()
+{
+	return trace.length();
+}
 
 
+// Get a field of the trace: word n is field (n%3) of record (n/3)
+int
+trace_read(int n)
+{
+	if (n < 0 || n / 3 >= trace.length())
+		return 0;
+	
+	const TraceRecord &r = trace.get(n / 3);
+	switch (n % 3) {
+		case 0:  return r.time;
+		case 1:  return r.kind;
+		default: return r.value;
+	}
+}
 
-/******************************************************************************
- * Washing Machine Sensor                                                     *
- ******************************************************************************/
+#endif
 
-// Event fired when washing finishes
-SHETSource::LocalEvent *washing_started;
-SHETSource::LocalEvent *washing_finished;
 
-static unsigned long washing_start_time = 0;
+void
+trace_init()
+{
+#if TRACE_CAPTURE
+	shetsource.AddAction(TRACE_START_NAME, trace_start);
+	shetsource.AddAction(TRACE_LENGTH_NAME, trace_length);
+	shetsource.AddAction(TRACE_READ_NAME, trace_read);
+#endif
+}
 
 
-// Getter for washing state
+// Read an analog sensor
 int
-get_washing_state()
+sensor_read(int apin)
 {
-	return (analogRead(APIN_WASHING) < WASHING_STATE_THRESHOLD)
-	       ? (int)((millis() - washing_start_time) / 1000l)
-	       : 0;
+	int value = analogRead(apin);
+	
+#if TRACE_CAPTURE
+	// Record crossings of the reading's threshold, so the replay fires the
+	// same events, and moves of more than the deadband, so levels (e.g. the
+	// washing machine's activity) survive. Noise in between is dropped.
+	int last = trace_analog[apin];
+	int threshold = trace_threshold(apin);
+	if (last < 0
+	    || abs(value - last) > TRACE_ANALOG_DEADBAND
+	    || (threshold >= 0 && trace_side(value, threshold) != trace_side(last, threshold))) {
+		trace.record(TRACE_ANALOG | apin, value);
+		trace_analog[apin] = value;
+	}
+#endif
+	
+	return value;
 }
 
 
+// Number of state-changing SHET calls handled
+uint8_t shet_activity = 0;
+
+
+// Note the state of a digital input port
 void
-washing_init()
+port_read(TracePort port, int value)
 {
-	// Add SHET properties
-	washing_finished = shetsource.AddEvent(WASHING_FINISHED_NAME);
-	washing_started = shetsource.AddEvent(WASHING_STARTED_NAME);
-	shetsource.AddAction(WASHING_STATE_NAME, get_washing_state);
+#if TRACE_CAPTURE
+	if (value != trace_port[port]) {
+		trace.record(TRACE_PORT | port, value);
+		trace_port[port] = value;
+	}
+#endif
 }
 
 
+// Note an incoming SHET call
 void
-washing_refresh()
+shet_called(ShetCall call, int arg)
 {
-	static bool state = false;
-	bool new_state = analogRead(APIN_WASHING) < WASHING_STATE_THRESHOLD;
-	
-	if (state != new_state && new_state == false) {
-		// Washing finished
-		int run_time = (millis() - washing_start_time) / 1000;
-		if (run_time >= WASHING_MIN)
-			(*washing_finished)(run_time);
-	} else if (state != new_state && new_state == true) {
-		// Washing started
-		if (millis() - washing_start_time > 5000)
-			(*washing_started)();
-		washing_start_time = millis();
-	}
+	shet_activity++;
 	
-	state = new_state;
+#if TRACE_CAPTURE
+	trace.record(TRACE_CALL | call, arg);
+#endif
 }
 
 
 
+
 /******************************************************************************
- * Oven Sensor                                                                *
+ * SHET Servicing                                                             *
  ******************************************************************************/
 
-SHETSource::LocalEvent *oven_on;
-SHETSource::LocalEvent *oven_off;
+// Most messages handled in one pass, total handled (saturating) and the
+// longest time a message waited for the rest of the loop (0.1ms units)
+int shet_max_drained = 0;
+unsigned int shet_handled = 0;
+unsigned int shet_max_wait = 0;
 
-int oven_state = false;
+// When SHET was last serviced without finding a message
+unsigned long shet_idle_since = 0;
 
+// Set by the pin-change interrupt on PIN_SHETSOURCE_READ, which LOW_POWER_IDLE
+// enables only while asleep (the interrupt clears the flag polled below)
+volatile bool shet_line_changed = false;
 
-void
-oven_init(void)
+
+// Whether PIN_SHETSOURCE_READ (PCINT23) has changed since the last call.
+// The server drives this line to send, so no change means no traffic.
+bool
+shet_line_take()
 {
-	oven_on  = shetsource.AddEvent(OVEN_ON_NAME);
-	oven_off = shetsource.AddEvent(OVEN_OFF_NAME);
-	shetsource.AddProperty(OVEN_STATE_NAME, &oven_state);
+	bool changed = shet_line_changed || (PCIFR & _BV(PCIF2));
+	PCIFR = _BV(PCIF2);
+	shet_line_changed = false;
+	return changed;
+}
+
+
+// Call DoSHET() once, returns true if it handled a message. Getters don't
+// report themselves so traffic on the read line also counts.
+bool
+shet_service_one()
+{
+	uint8_t activity = shet_activity;
+	shet_line_take();
+	
+	shetsource.DoSHET();
+	
+	return shet_activity != activity || shet_line_take();
 }
 
 
+// Service SHET, handling messages until they run out or the budget is spent
 void
-oven_refresh()
+shet_service()
 {
-	int new_state = analogRead(APIN_OVEN) > OVEN_STATE_THRESHOLD;
+	unsigned long start = micros();
+	int drained = 0;
 	
-	if (oven_state != new_state) {
-		if (new_state)
-			(*oven_on)();
-		else
-			(*oven_off)();
+	while (shet_service_one()) {
+		// The first message had been waiting since the link was last idle
+		if (drained == 0) {
+			unsigned long wait = (start - shet_idle_since) / 100ul;
+			if (wait > shet_max_wait)
+				shet_max_wait = min(wait, 0x7FFFul);
+		}
+		
+		drained++;
+		if (shet_handled != 0xFFFF)
+			shet_handled++;
+		
+		if (micros() - start >= (unsigned int)config.shet_budget)
+			break;
 	}
 	
-	oven_state = new_state;
+	if (drained > shet_max_drained)
+		shet_max_drained = drained;
+	
+	// Anything left was only just missed
+	shet_idle_since = micros();
 }
 
 
+// Getter for the statistics: 0 most handled in one pass, 1 total handled, 2
+// longest wait (0.1ms)
+int
+get_shet_stats(int field)
+{
+	switch (field) {
+		case 0:  return shet_max_drained;
+		case 1:  return min(shet_handled, 0x7FFFu);
+		case 2:  return shet_max_wait;
+		default: return -1;
+	}
+}
 
-/******************************************************************************
- * Lightswitch                                                                *
- ******************************************************************************/
-
-SHETSource::LocalEvent *lightswitch;
 
 void
-lightswitch_init(void)
+reset_shet_stats()
 {
-	lightswitch = shetsource.AddEvent(LIGHTSWITCH_PRESSED_NAME);
-	pinMode(&expander, PIN_LIGHTSWITCH, INPUT);
-	digitalWrite(&expander, PIN_LIGHTSWITCH, HIGH);
+	shet_max_drained = 0;
+	shet_handled = 0;
+	shet_max_wait = 0;
 }
 
 
 void
-lightswitch_refresh()
+shet_service_init()
 {
-	static int state = false;
-	int new_state = digitalRead(&expander, PIN_LIGHTSWITCH);
+	// The pin-change flag is polled, the interrupt stays off unless idling
+	PCMSK2 |= _BV(PCINT23);
 	
-	if (state != new_state && new_state == true)
-		(*lightswitch)();
-	
-	state = new_state;
+	shetsource.AddAction(SHET_STATS_NAME, get_shet_stats);
+	shetsource.AddAction(SHET_STATS_RESET_NAME, reset_shet_stats);
 }
 
 
 
 /******************************************************************************
- * Backdoor Sensor                                                            *
+ * Event Timestamps                                                           *
  ******************************************************************************/
 
-SHETSource::LocalEvent *backdoor_opened;
-SHETSource::LocalEvent *backdoor_closed;
-int backdoor_state = false;
+// The server estimates the offset to the node's clock by timing a call to
+// clock_now and unwraps the 15-bit times against its own clock.
+
+// Raise event_stamp after each input event with the time it was sampled
+int event_stamps = false;
+SHETSource::LocalEvent *event_stamp;
+
+// Time from an input change being sampled to its event being sent (0.1ms
+// units, saturating): the last, the longest and the number of events
+unsigned int event_latency = 0;
+unsigned int event_max_latency = 0;
+unsigned int event_count = 0;
+
+
+// The node's clock (ms, wrapping every 32.768s)
+int clock_now() { return tick.ms & 0x7FFF; }
+
 
+// Call after raising an event for an input change, with the time the input
+// was sampled (which may have been in an earlier pass)
 void
-backdoor_init(void)
+event_raised(const Tick &sampled)
 {
-	shetsource.AddProperty(BACKDOOR_STATE_NAME, &backdoor_state);
-	backdoor_opened = shetsource.AddEvent(BACKDOOR_OPENED_NAME);
-	backdoor_closed = shetsource.AddEvent(BACKDOOR_CLOSED_NAME);
+	unsigned long latency = (micros() - sampled.us) / 100ul;
+	event_latency = min(latency, 0x7FFFul);
+	if (event_latency > event_max_latency)
+		event_max_latency = event_latency;
+	if (event_count != 0xFFFF)
+		event_count++;
 	
-	pinMode(&expander, PIN_BACKDOOR, INPUT);
-	digitalWrite(&expander, PIN_BACKDOOR, HIGH);
+	if (event_stamps)
+		(*event_stamp)(sampled.ms & 0x7FFF);
 }
 
 
-void
-backdoor_refresh()
+// Getter for event latencies: 0 last (0.1ms), 1 longest (0.1ms), 2 number of
+// events
+int
+get_event_latency(int field)
 {
+	switch (field) {
+		case 0: return event_latency;
+		case 1: return event_max_latency;
+		case 2: return min(event_count, 0x7FFFu);
+		default: return -1;
+	}
+}
+
+
+void
+reset_event_latency()
+{
+	event_latency = 0;
+	event_max_latency = 0;
+	event_count = 0;
+}
+
+
+void
+event_stamps_init()
+{
+	event_stamp = shetsource.AddEvent(EVENT_STAMP_NAME);
+	shetsource.AddProperty(EVENT_STAMPS_NAME, &event_stamps);
+	shetsource.AddAction(CLOCK_NOW_NAME, clock_now);
+	shetsource.AddAction(EVENT_LATENCY_NAME, get_event_latency);
+	shetsource.AddAction(EVENT_LATENCY_RESET_NAME, reset_event_latency);
+}
+
+
+
+/******************************************************************************
+ * Property Change Notifications                                              *
+ ******************************************************************************/
+
+// Pushed properties are packed into each frame in the order they're added:
+//   bit  0   light_kitchen
+//   bit  1   light_lounge
+//   bit  2   oven_heating
+//   bit  3   occupied
+//   bits 4-8 btn_mode
+//   bit  9   backdoor_open
+Notifier notifier;
+
+SHETSource::LocalEvent *props_changed;
+
+
+// Add a SHET property which is also pushed when it changes
+void
+add_pushed_property(char *name, int *value, uint8_t bits)
+{
+	shetsource.AddProperty(name, value);
+	notifier.watch(value, bits);
+}
+
+void
+add_pushed_property(char *name, void (*setter)(int), int (*getter)(), uint8_t bits)
+{
+	shetsource.AddProperty(name, setter, getter);
+	notifier.watch(getter, bits);
+}
+
+
+// Minimum interval between pushes (ms), zero disables pushing
+// Negative intervals are ignored, zero stops pushing
+void
+set_push_interval(int interval)
+{
+	if (interval >= 0)
+		notifier.set_interval(interval);
+}
+
+
+int get_push_interval() { return notifier.get_interval(); }
+
+
+void
+props_init()
+{
+	props_changed = shetsource.AddEvent(PROPS_CHANGED_NAME);
+	shetsource.AddProperty(PUSH_INTERVAL_NAME, set_push_interval, get_push_interval);
+}
+
+
+void
+props_refresh()
+{
+	if (notifier.refresh(tick))
+		(*props_changed)(notifier.frame());
+}
+
+
+
+
+/******************************************************************************
+ * I/O Expander Board Boiler-Plate                                            *
+ ******************************************************************************/
+
+io_expander expander;
+
+// Set once the expander and the pins on it have been configured (by boot_io),
+// anything driven from SHET must not touch the expander before then
+bool io_ready = false;
+
+void
+io_init(void)
+{
+	Wire.begin();
+	pinMode(PIN_IO_INTERRUPT, INPUT);
+	digitalWrite(PIN_IO_INTERRUPT, LOW);
+	init_io_expander(&expander, IO_EXPANDER_ADDRESS);
+}
+
+
+
+/******************************************************************************
+ * Analog Sampling                                                            *
+ ******************************************************************************/
+
+// All analog inputs are sampled together, the sensors below read the latest
+// samples and the server can watch any channel for changes.
+AnalogWatch analog = AnalogWatch(sensor_read);
+
+// Blocks of samples from one channel at a high rate for telling apart loads
+// (eg. oven element from fan, wash from spin) by their waveform.
+WaveCapture capture;
+
+SHETSource::LocalEvent *analog_changed;
+SHETSource::LocalEvent *analog_crossed;
+SHETSource::LocalEvent *capture_done;
+
+// When the current samples were taken
+Tick analog_sampled;
+
+
+void
+analog_on_change(int channel, int value)
+{
+	(*analog_changed)((channel << 12) | value);
+	event_raised(analog_sampled);
+}
+
+
+void
+analog_on_cross(int channel, bool above)
+{
+	(*analog_crossed)((channel << 1) | above);
+	event_raised(analog_sampled);
+}
+
+
+// Watch command:
+//   bits 0-9   value
+//   bits 10-12 0 threshold, 1 hysteresis, 2 deadband, 3 interval (100ms),
+//              4 stop watching
+//   bits 13-15 channel
+void
+analog_watch(int cmd)
+{
+	shet_called(CALL_ANALOG_WATCH, cmd);
+	
+	unsigned int c = cmd;
+	int channel = c >> 13;
+	int value = c & 0x3FF;
+	
+	switch ((c >> 10) & 0x7) {
+		case 0: analog.set_threshold(channel, value);       break;
+		case 1: analog.set_hysteresis(channel, value);      break;
+		case 2: analog.set_deadband(channel, value);        break;
+		case 3: analog.set_interval(channel, value * 100ul); break;
+		case 4: analog.unwatch(channel);                    break;
+	}
+}
+
+
+int
+analog_read(int channel)
+{
+	if (channel < 0 || channel >= NUM_APINS)
+		return -1;
+	return analog.get(channel);
+}
+
+
+// Capture command (the block is ready when capture_done is raised with its
+// RMS):
+//   bits 0-2   channel
+//   bits 3-10  keep every n'th sample (n=0 is treated as 1)
+//   bits 11-15 frequency bin (cycles per block) to measure
+int
+capture_start(int cmd)
+{
+	shet_called(CALL_CAPTURE_START, cmd);
+	
+	unsigned int c = cmd;
+	return capture.start(c & 0x7, (c >> 3) & 0xFF, c >> 11);
+}
+
+
+// A sample from the last block, there is no bulk transfer so the block is
+// read back one sample at a time.
+int
+capture_read(int n)
+{
+	if (n < 0 || n >= WaveCapture::LENGTH || capture.is_running())
+		return -1;
+	return capture.get_sample(n);
+}
+
+
+// Summary of the last block: 0 mean, 1 RMS, 2 peak, 3 bin amplitude, 4 sample
+// rate (Hz). Amplitudes are in 8-bit ADC units.
+int
+capture_result(int field)
+{
+	switch (field) {
+		case 0: return capture.mean;
+		case 1: return capture.rms;
+		case 2: return capture.peak;
+		case 3: return capture.band;
+		case 4: return capture.get_sample_rate();
+		default: return -1;
+	}
+}
+
+
+void
+analog_init()
+{
+	analog.on_change = analog_on_change;
+	analog.on_cross  = analog_on_cross;
+	
+	analog_changed = shetsource.AddEvent(ANALOG_CHANGED_NAME);
+	analog_crossed = shetsource.AddEvent(ANALOG_CROSSED_NAME);
+	shetsource.AddAction(ANALOG_WATCH_NAME, analog_watch);
+	shetsource.AddAction(ANALOG_READ_NAME, analog_read);
+	
+	capture_done = shetsource.AddEvent(CAPTURE_DONE_NAME);
+	shetsource.AddAction(CAPTURE_START_NAME, capture_start);
+	shetsource.AddAction(CAPTURE_READ_NAME, capture_read);
+	shetsource.AddAction(CAPTURE_RESULT_NAME, capture_result);
+}
+
+
+// Take the first samples for the sensors set up during boot so none of them
+// starts from a zero reading. Nothing can be capturing yet.
+void
+analog_prime()
+{
+	tick_capture(analog_sampled);
+	analog.refresh(analog_sampled.ms);
+}
+
+
+// The ADC is busy while a waveform is being captured
+void
+analog_refresh()
+{
+	if (!capture.is_running()) {
+		tick_capture(analog_sampled);
+		analog.refresh(analog_sampled.ms);
+	}
+	
+	if (capture.refresh())
+		(*capture_done)(capture.rms);
+}
+
+
+
+/******************************************************************************
+ * Lights                                                                     *
+ ******************************************************************************/
+
+// All light servos are pulsed one after the other from a single timer
+ServoPulse servos;
+
+Lighting light_kitchen = Lighting(&servos, PIN_SERVO_KITCHEN,
+                                  SERVO_KITCHEN_OFF,
+                                  SERVO_KITCHEN_IDLE,
+                                  SERVO_KITCHEN_ON);
+
+Lighting light_lounge  = Lighting(&servos, PIN_SERVO_LOUNGE,
+                                  SERVO_LOUNGE_OFF,
+                                  SERVO_LOUNGE_IDLE,
+                                  SERVO_LOUNGE_ON);
+
+bool light_kitchen_requested, light_kitchen_state;
+bool light_lounge_requested,  light_lounge_state;
+
+SHETSource::LocalEvent *lightswitch_pressed;
+
+// Raised when a light's sensor shows it was changed behind our back: bit 0
+// light (0 kitchen, 1 lounge), bit 1 its real state
+SHETSource::LocalEvent *light_drift;
+
+// When each light started disagreeing with its sensor
+unsigned long light_kitchen_mismatch, light_lounge_mismatch;
+
+
+// Setters
+void
+set_light_kitchen(int s)
+{
+	shet_called(CALL_LIGHT_KITCHEN, s);
+	light_kitchen_requested = true;
+	light_kitchen_state = s;
+}
+
+void
+set_light_lounge(int s)
+{
+	shet_called(CALL_LIGHT_LOUNGE, s);
+	light_lounge_requested = true;
+	light_lounge_state = s;
+}
+
+// Getters
+int get_light_kitchen() { return light_kitchen.get(); }
+int get_light_lounge()  { return light_lounge.get(); }
+
+void
+lights_toggle()
+{
+	shet_called(CALL_LIGHT_TOGGLE, 0);
+	light_kitchen_requested = light_lounge_requested = true;
+	light_kitchen_state = light_lounge_state
+		= !(light_lounge.get() && light_kitchen.get());
+}
+
+
+// Is a light with a sensor already in the given state?
+bool
+light_sensed_as(int apin, bool state)
+{
+	return apin >= 0 && (analog.get(apin) > config.light_threshold) == state;
+}
+
+
+// Check a light against its sensor, believing the sensor once they have
+// disagreed for a while
+void
+light_verify(Lighting &light, int apin, int id, unsigned long &mismatch)
+{
+	if (apin < 0 || light.is_busy(tick) || light_sensed_as(apin, light.get())) {
+		mismatch = tick.ms;
+		return;
+	}
+	
+	if (tick.ms - mismatch > LIGHT_SETTLE_TIME) {
+		light.sync(!light.get());
+		(*light_drift)((light.get() << 1) | id);
+		event_raised(analog_sampled);
+	}
+}
+
+
+// Move a light unless its sensor shows it is already in the state
+void
+light_set(Lighting &light, int apin, bool state)
+{
+	if (light_sensed_as(apin, state))
+		light.sync(state);
+	else
+		light.set(state, tick);
+}
+
+
+// Pick up the configured servo angles and holding
+void
+lights_configure()
+{
+	light_kitchen.set_angles(config.servo_kitchen_off,
+	                         config.servo_kitchen_idle,
+	                         config.servo_kitchen_on);
+	light_lounge.set_angles(config.servo_lounge_off,
+	                        config.servo_lounge_idle,
+	                        config.servo_lounge_on);
+	
+	light_kitchen.set_hold(config.servo_hold);
+	light_lounge.set_hold(config.servo_hold);
+}
+
+
+void
+lights_init()
+{
+	// Setup lightswitch
+	//pinMode(APIN_LIGHTSWITCH, INPUT);
+	//digitalWrite(APIN_LIGHTSWITCH, LOW);
+	
+	// Servos are only pulsed once they are homed
+	servos.begin();
+	
+	// Sample any light level sensors
+	if (APIN_LIGHT_KITCHEN >= 0)
+		analog.use(APIN_LIGHT_KITCHEN);
+	if (APIN_LIGHT_LOUNGE >= 0)
+		analog.use(APIN_LIGHT_LOUNGE);
+	
+	// Add SHET properties
+	add_pushed_property(LIGHT_KITCHEN_NAME, set_light_kitchen, get_light_kitchen, 1);
+	add_pushed_property(LIGHT_LOUNGE_NAME,  set_light_lounge,  get_light_lounge,  1);
+	
+	shetsource.AddAction(LIGHT_TOGGLE_NAME, lights_toggle);
+	light_drift = shetsource.AddEvent(LIGHT_DRIFT_NAME);
+}
+
+
+void
+lights_refresh()
+{
+	//int pin = analogRead(APIN_LIGHTSWITCH);
+	//bool new_btn_state = pin < LIGHTSWITCH_THRESHOLD;
+	//bool new_pir_state = (pin > LIGHTSWITCH_THRESHOLD) && (pin < PIR_THRESHOLD);
+	
+	// TODO: Rewrite with button library
+	// Handle button
+	//static bool btn_state = false;
+	//if (new_btn_state != btn_state && new_btn_state == true)
+	//	(*lightswitch_pressed)();
+	//btn_state = new_btn_state;
+	
+	// Refresh servos
+	light_kitchen.refresh(tick);
+	light_lounge.refresh(tick);
+	
+	// Catch lights switched by hand
+	light_verify(light_kitchen, APIN_LIGHT_KITCHEN, 0, light_kitchen_mismatch);
+	light_verify(light_lounge,  APIN_LIGHT_LOUNGE,  1, light_lounge_mismatch);
+	
+	// Disalow simultaneous changes
+	if (light_kitchen_requested && !light_lounge.is_busy(tick)) {
+		light_set(light_kitchen, APIN_LIGHT_KITCHEN, light_kitchen_state);
+		light_kitchen_requested = false;
+	}
+	if (light_lounge_requested && !light_kitchen.is_busy(tick)) {
+		light_set(light_lounge, APIN_LIGHT_LOUNGE, light_lounge_state);
+		light_lounge_requested = false;
+	}
+}
+
+
+
+
+/******************************************************************************
+ * PIR                                                                        *
+ ******************************************************************************/
+
+// Lounge PIR event
+SHETSource::LocalEvent *pir;
+
+// Lounge occupancy
+Occupancy occupancy = Occupancy(PIR_WINDOW, OCCUPANCY_TIMEOUT);
+SHETSource::LocalEvent *occupancy_changed;
+int occupied = false;
+
+
+int get_motion_level() { return occupancy.get_motion_level(); }
+
+// Occupancy timeout in seconds
+// Timeouts of zero or below are ignored
+void
+set_occupancy_timeout(int t)
+{
+	if (t > 0)
+		occupancy.set_timeout(t * 1000ul);
+}
+
+
+int get_occupancy_timeout() { return occupancy.get_timeout() / 1000ul; }
+
+
+void
+pir_init(void)
+{
+	analog.use(APIN_PIR);
+	
+	if (PIR_RAW_EVENTS)
+		pir = shetsource.AddEvent(PIR_NAME);
+	
+	occupancy_changed = shetsource.AddEvent(OCCUPANCY_CHANGED_NAME);
+	add_pushed_property(OCCUPIED_NAME, &occupied, 1);
+	shetsource.AddAction(MOTION_LEVEL_NAME, get_motion_level);
+	shetsource.AddProperty(OCCUPANCY_TIMEOUT_NAME, set_occupancy_timeout,
+	                                               get_occupancy_timeout);
+}
+
+
+void
+pir_refresh(void)
+{
+	static bool pir_state = false;
+	bool new_pir_state = analog.get(APIN_PIR) < config.pir_threshold;
+	
+	// Handle PIR
+	if (PIR_RAW_EVENTS && new_pir_state != pir_state && new_pir_state == true) {
+		(*pir)();
+		event_raised(analog_sampled);
+	}
+	pir_state = new_pir_state;
+	
+	// Only report when the room's occupancy changes
+	if (occupancy.update(new_pir_state, tick.ms)) {
+		occupied = occupancy.is_occupied();
+		(*occupancy_changed)(occupied);
+		event_raised(analog_sampled);
+	}
+}
+
+
+
+/******************************************************************************
+ * rgb led                                                                    *
+ ******************************************************************************/
+
+RGBLED rgbled = RGBLED(PIN_RGBLED_R, PIN_RGBLED_G, PIN_RGBLED_B);
+
+// Layers of the LED, higher layers are drawn over lower ones
+enum RGBLEDLayer {
+	LAYER_BASE = 0, // Colour set by the server
+	LAYER_MODE,     // Button panel mode indication
+	LAYER_HOLD,     // Long-press progress
+	LAYER_ALERT,    // Alerts set by the server
+};
+
+// Colours which can be selected by a packed colour command
+uint8_t rgbled_palette[RGBLED_PALETTE_SIZE][3] = {{  0,  0,  0},  // Off
+                                                  {255,255,255},  // White
+                                                  {255,  0,  0},  // Red
+                                                  {  0,255,  0},  // Green
+                                                  {  0,  0,255},  // Blue
+                                                  {255,255,  0},  // Yellow
+                                                  {  0,255,255},  // Cyan
+                                                  {255,  0,255},  // Magenta
+                                                  {255,127,  0},  // Orange
+                                                  {255,191,127}}; // Warm white
+
+// Red and green for the next direct colour/palette entry
+int rgbled_staged_rg = 0;
+
+// Colour Decoder
+Colour
+decode_colour(int encoded)
+{
+	// Expand 15-bit colour into 24-bit colour
+	Colour colour;
+	colour.r = ((encoded >>  0) & 0x1F) << 3;
+	colour.g = ((encoded >>  5) & 0x1F) << 3;
+	colour.b = ((encoded >> 10) & 0x1F) << 3;
+	return colour;
+}
+
+
+// Set the server's colour, replacing any mode indication
+void
+set_rgbled_base(const Colour &colour, int duration, Easing easing)
+{
+	rgbled.set_colour(colour, duration, easing);
+	rgbled.clear_layer(LAYER_MODE, duration);
+}
+
+void
+set_rgbled_colour(int encoded, int duration)
+{
+	set_rgbled_base(decode_colour(encoded), duration, EASE_LINEAR);
+}
+
+void
+set_rgbled_layer(int layer, int r, int g, int b, int duration)
+{
+	Colour colour;
+	colour.r = r;
+	colour.g = g;
+	colour.b = b;
+	rgbled.set_layer(layer, colour, duration);
+}
+
+
+// Setters
+void
+set_rgbled_colour_instant(int encoded)
+{
+	shet_called(CALL_RGBLED_INSTANT, encoded);
+	set_rgbled_colour(encoded, 0);
+}
+
+void
+set_rgbled_colour_fast(int encoded)
+{
+	shet_called(CALL_RGBLED_FAST, encoded);
+	set_rgbled_colour(encoded, config.rgbled_fade_fast);
+}
+
+
+// Stage the red (high byte) and green (low byte) of a 24-bit colour
+void
+set_rgbled_rg(int rg)
+{
+	shet_called(CALL_RGBLED_RG, rg);
+	rgbled_staged_rg = rg;
+}
+
+
+// Packed colour command:
+//   bits 0-7   palette index, or blue for a direct colour
+//   bits 8-11  index into RGBLED_DURATIONS
+//   bits 12-13 easing
+//   bit  14    direct colour, red/green come from set_rgbled_rg
+void
+set_rgbled_cmd(int cmd)
+{
+	shet_called(CALL_RGBLED_CMD, cmd);
+	
+	uint8_t data = cmd & 0xFF;
+	int duration = RGBLED_DURATIONS[(cmd >> 8) & 0xF];
+	Easing easing = (Easing)((cmd >> 12) & 0x3);
+	
+	Colour colour;
+	if (cmd & 0x4000) {
+		colour.r = (rgbled_staged_rg >> 8) & 0xFF;
+		colour.g = rgbled_staged_rg & 0xFF;
+		colour.b = data;
+	} else {
+		if (data >= RGBLED_PALETTE_SIZE)
+			return;
+		colour.r = rgbled_palette[data][0];
+		colour.g = rgbled_palette[data][1];
+		colour.b = rgbled_palette[data][2];
+	}
+	
+	set_rgbled_base(colour, duration, easing);
+}
+
+
+// Store the staged red/green plus blue (bits 0-7) in palette entry (bits 8-11)
+void
+set_rgbled_palette(int entry)
+{
+	shet_called(CALL_RGBLED_PALETTE, entry);
+	
+	uint8_t *colour = rgbled_palette[(entry >> 8) & 0xF];
+	colour[0] = (rgbled_staged_rg >> 8) & 0xFF;
+	colour[1] = rgbled_staged_rg & 0xFF;
+	colour[2] = entry & 0xFF;
+}
+
+
+// Show an alert colour over everything else until it is cleared
+void
+set_rgbled_alert(int encoded)
+{
+	shet_called(CALL_RGBLED_ALERT, encoded);
+	rgbled.set_layer(LAYER_ALERT, decode_colour(encoded), config.rgbled_fade_fast);
+}
+
+void
+clear_rgbled_alert()
+{
+	shet_called(CALL_RGBLED_ALERT, -1);
+	rgbled.clear_layer(LAYER_ALERT, config.rgbled_fade_fast);
+}
+
+
+void
+rgbled_init()
+{
+	// Set up pins
+	rgbled.attach();
+	rgbled.refresh(true);
+	
+	// Add SHET actions
+	shetsource.AddAction(RGBLED_SET_INSTANT_NAME, set_rgbled_colour_instant);
+	shetsource.AddAction(RGBLED_SET_FAST_NAME, set_rgbled_colour_fast);
+	shetsource.AddAction(RGBLED_SET_RG_NAME, set_rgbled_rg);
+	shetsource.AddAction(RGBLED_SET_CMD_NAME, set_rgbled_cmd);
+	shetsource.AddAction(RGBLED_SET_PALETTE_NAME, set_rgbled_palette);
+	shetsource.AddAction(RGBLED_SET_ALERT_NAME, set_rgbled_alert);
+	shetsource.AddAction(RGBLED_CLEAR_ALERT_NAME, clear_rgbled_alert);
+}
+
+
+// Call an update on the LED (for fading etc).
+void
+rgbled_refresh()
+{
+	rgbled.refresh(tick);
+}
+
+
+
+/******************************************************************************
+ * LED Channels                                                               *
+ ******************************************************************************/
+
+// Channel pins with this bit set are on the expander (and are on/off only)
+static const uint8_t CHANNEL_ON_EXPANDER = 0x80;
+
+static const uint8_t LED_CHANNEL_PINS[]  = {PIN_ACCENT_LED,
+                                            PIN_STATUS_LED | CHANNEL_ON_EXPANDER};
+static const int NUM_LED_CHANNELS        = 2;
+
+
+// The state last written to each expander channel (-1 for none yet). A fade
+// writes every step, so these stop each step costing an I2C transaction.
+int8_t led_channel_states[NUM_LED_CHANNELS];
+
+
+void
+led_channel_write(uint8_t pin, uint8_t level)
+{
+	if (!(pin & CHANNEL_ON_EXPANDER)) {
+		analogWrite(pin, level);
+		return;
+	}
+	
+	int8_t state = level >= 128 ? HIGH : LOW;
+	for (int i = 0; i < NUM_LED_CHANNELS; i++) {
+		if (LED_CHANNEL_PINS[i] == pin) {
+			if (led_channel_states[i] == state)
+				return;
+			led_channel_states[i] = state;
+		}
+	}
+	
+	digitalWrite(&expander, pin & ~CHANNEL_ON_EXPANDER, state);
+}
+
+
+LEDChannels led_channels = LEDChannels(led_channel_write);
+
+
+// Channel command:
+//   bits 0-7   level
+//   bits 8-11  index into RGBLED_DURATIONS
+//   bits 12-15 channel
+void
+set_led_channel(int cmd)
+{
+	shet_called(CALL_LED_CHANNEL, cmd);
+	led_channels.set((cmd >> 12) & 0xF,
+	                 cmd & 0xFF,
+	                 RGBLED_DURATIONS[(cmd >> 8) & 0xF]);
+}
+
+
+int
+get_led_channel(int channel)
+{
+	if (channel < 0 || channel >= led_channels.get_num_channels())
+		return -1;
+	return led_channels.get(channel);
+}
+
+
+void
+led_channels_init()
+{
+	shetsource.AddAction(LED_CHANNEL_SET_NAME, set_led_channel);
+	shetsource.AddAction(LED_CHANNEL_GET_NAME, get_led_channel);
+}
+
+
+// Channels are added once the expander is available
+void
+led_channels_io_init()
+{
+	for (int i = 0; i < NUM_LED_CHANNELS; i++) {
+		uint8_t pin = LED_CHANNEL_PINS[i];
+		led_channel_states[i] = -1;
+		if (pin & CHANNEL_ON_EXPANDER)
+			pinMode(&expander, pin & ~CHANNEL_ON_EXPANDER, OUTPUT);
+		else
+			pinMode(pin, OUTPUT);
+		led_channels.add(pin);
+	}
+}
+
+
+void led_channels_refresh() { led_channels.refresh(tick); }
+
+
+
+/******************************************************************************
+ * Washing Machine Sensor                                                     *
+ ******************************************************************************/
+
+// Event fired when washing finishes
+SHETSource::LocalEvent *washing_started;
+SHETSource::LocalEvent *washing_finished;
+
+WashingMonitor washing = WashingMonitor(WASHING_STATE_THRESHOLD,
+                                        WASHING_GAP,
+                                        WASHING_MIN * 1000ul);
+
+// Fields of each cycle returned by get_washing_history
+static const int WASHING_HISTORY_FIELDS = 7;
+
+
+// Getter for washing state
+int
+get_washing_state()
+{
+	return washing.get_run_time(millis()) / 1000ul;
+}
+
+
+int
+get_washing_phase()
+{
+	return washing.get_phase();
+}
+
+
+// Get field (n % 7) of the (n / 7)th most recent cycle: duration, fill, wash,
+// spin and pause times (s), number of pauses and peak activity
+int
+get_washing_history(int n)
+{
+	int cycle = n / WASHING_HISTORY_FIELDS;
+	if (n < 0 || cycle >= washing.get_history_length())
+		return -1;
+	
+	const WashingMonitor::Cycle &c = washing.get_cycle(cycle);
+	int field = n % WASHING_HISTORY_FIELDS;
+	switch (field) {
+		case 0:  return c.duration;
+		case 5:  return c.pauses;
+		case 6:  return c.peak;
+		default: return c.phase_time[field - 1];
+	}
+}
+
+
+void
+washing_init()
+{
+	washing.wash_level = WASHING_WASH_LEVEL;
+	washing.spin_deviation = WASHING_SPIN_DEVIATION;
+	analog.use(APIN_WASHING);
+	
+	// Add SHET properties
+	washing_finished = shetsource.AddEvent(WASHING_FINISHED_NAME);
+	washing_started = shetsource.AddEvent(WASHING_STARTED_NAME);
+	shetsource.AddAction(WASHING_STATE_NAME, get_washing_state);
+	shetsource.AddAction(WASHING_PHASE_NAME, get_washing_phase);
+	shetsource.AddAction(WASHING_HISTORY_NAME, get_washing_history);
+}
+
+
+void
+washing_refresh()
+{
+	switch (washing.update(analog.get(APIN_WASHING), tick.ms)) {
+		case WashingMonitor::EVENT_STARTED:
+			(*washing_started)();
+			event_raised(analog_sampled);
+			break;
+		
+		case WashingMonitor::EVENT_FINISHED:
+			(*washing_finished)(washing.get_cycle(0).duration);
+			event_raised(analog_sampled);
+			break;
+		
+		default:
+			break;
+	}
+}
+
+
+
+/******************************************************************************
+ * Oven Sensor                                                                *
+ ******************************************************************************/
+
+SHETSource::LocalEvent *oven_on;
+SHETSource::LocalEvent *oven_off;
+
+int oven_state = false;
+
+
+void
+oven_init(void)
+{
+	oven_on  = shetsource.AddEvent(OVEN_ON_NAME);
+	oven_off = shetsource.AddEvent(OVEN_OFF_NAME);
+	analog.use(APIN_OVEN);
+	add_pushed_property(OVEN_STATE_NAME, &oven_state, 1);
+}
+
+
+void
+oven_refresh()
+{
+	int new_state = analog.get(APIN_OVEN) > config.oven_threshold;
+	
+	if (oven_state != new_state) {
+		if (new_state)
+			(*oven_on)();
+		else
+			(*oven_off)();
+		event_raised(analog_sampled);
+	}
+	
+	oven_state = new_state;
+}
+
+
+
+/******************************************************************************
+ * Lightswitch                                                                *
+ ******************************************************************************/
+
+SHETSource::LocalEvent *lightswitch;
+
+void
+lightswitch_init(void)
+{
+	lightswitch = shetsource.AddEvent(LIGHTSWITCH_PRESSED_NAME);
+}
+
+
+void
+lightswitch_io_init(void)
+{
+	pinMode(&expander, PIN_LIGHTSWITCH, INPUT);
+	digitalWrite(&expander, PIN_LIGHTSWITCH, HIGH);
+}
+
+
+void
+lightswitch_refresh()
+{
+	static int state = false;
+	Tick sampled;
+	tick_capture(sampled);
+	int new_state = digitalRead(&expander, PIN_LIGHTSWITCH);
+	port_read(PORT_LIGHTSWITCH, new_state);
+	
+	if (state != new_state && new_state == true) {
+		(*lightswitch)();
+		event_raised(sampled);
+	}
+	
+	state = new_state;
+}
+
+
+
+/******************************************************************************
+ * Backdoor Sensor                                                            *
+ ******************************************************************************/
+
+SHETSource::LocalEvent *backdoor_opened;
+SHETSource::LocalEvent *backdoor_closed;
+int backdoor_state = false;
+
+void
+backdoor_init(void)
+{
+	add_pushed_property(BACKDOOR_STATE_NAME, &backdoor_state, 1);
+	backdoor_opened = shetsource.AddEvent(BACKDOOR_OPENED_NAME);
+	backdoor_closed = shetsource.AddEvent(BACKDOOR_CLOSED_NAME);
+}
+
+
+void
+backdoor_io_init(void)
+{
+	pinMode(&expander, PIN_BACKDOOR, INPUT);
+	digitalWrite(&expander, PIN_BACKDOOR, HIGH);
+}
+
+
+void
+backdoor_refresh()
+{
+	Tick sampled;
+	tick_capture(sampled);
 	int new_state = digitalRead(&expander, PIN_BACKDOOR);
+	port_read(PORT_BACKDOOR, new_state);
+	
+	if (backdoor_state != new_state) {
+		if (new_state)
+			(*backdoor_opened)();
+		else
+			(*backdoor_closed)();
+		event_raised(sampled);
+	}
+	
+	backdoor_state = new_state;
+}
+
+
+
+/******************************************************************************
+ * Button Panel                                                               *
+ ******************************************************************************/
+
+ButtonManager<uint8_t> btns = ButtonManager<uint8_t>(LONG_PRESS,
+                                                     NUM_MODES,
+                                                     NUM_BTN_NORM,
+                                                     BTN_NORM_MASKS,
+                                                     NUM_BTN_MODE,
+                                                     BTN_MODE_MASKS,
+                                                     NUM_BTN_MOD,
+                                                     BTN_MOD_MASKS);
+
+SHETSource::LocalEvent *evt_on_press;
+SHETSource::LocalEvent *evt_on_mode_change;
+
+// When the buttons were last read
+Tick btns_sampled;
+
+
+void
+btn_set_colour(int mode)
+{
+	set_rgbled_layer(LAYER_MODE,
+	                 MODE_COLOURS[mode&0x3][mode>>2][0],
+	                 MODE_COLOURS[mode&0x3][mode>>2][1],
+	                 MODE_COLOURS[mode&0x3][mode>>2][2],
+	                 config.rgbled_fade_fast);
+}
+
+
+void
+btn_on_press(int mode, uint8_t modifiers, bool long_press, uint8_t buttons)
+{
+	int encoded = 0;
+	encoded = mode;
+	encoded = (encoded<<NUM_BTN_MOD) | modifiers;
+	encoded = (encoded<<1) | long_press;
+	encoded = (encoded<<NUM_BTN_NORM) | buttons;
+	(*evt_on_press)(encoded);
+	event_raised(btns_sampled);
+}
+
+
+void
+btn_mode_changed(int mode)
+{
+	btn_set_colour(mode);
+	(*evt_on_mode_change)(mode);
+}
+
+
+void
+btn_on_mode_change(int mode)
+{
+	btn_mode_changed(mode);
+	event_raised(btns_sampled);
+}
+
+
+void
+btn_on_hold_start(bool starting)
+{
+	// Start fading the LED off
+	set_rgbled_layer(LAYER_HOLD, 0,0,0, config.long_press);
+}
+
+
+void
+btn_on_hold_end(bool finished)
+{
+	// Flash green if the hold completed
+	if (finished)
+		set_rgbled_layer(LAYER_HOLD, 0,255,0, 0);
+	
+	// Reveal whatever is underneath again
+	rgbled.clear_layer(LAYER_HOLD, config.rgbled_fade_fast);
+}
+
+
+void
+btn_set_mode(int mode)
+{
+	shet_called(CALL_BTN_MODE, mode);
+	// Not an input change, so no latency or stamp
+	if (btns.set_mode(mode))
+		btn_mode_changed(mode);
+}
+
+
+int
+btn_get_mode()
+{
+	return btns.mode;
+}
+
+
+void
+btns_init()
+{
+	// Setup SHET events
+	evt_on_press = shetsource.AddEvent(BTNS_ON_PRESS_NAME);
+	evt_on_mode_change = shetsource.AddEvent(BTNS_ON_MODE_CHANGE_NAME);
+	add_pushed_property(BTNS_MODE, btn_set_mode, btn_get_mode, BTN_MODE_BITS);
+	
+	
+	// Bind callbacks
+	btns.on_mode_change = btn_on_mode_change;
+	btns.on_press       = btn_on_press;
+	btns.on_hold_start  = btn_on_hold_start;
+	btns.on_hold_end    = btn_on_hold_end;
+	
+	btn_set_colour(btns.mode);
+}
+
+
+void
+btns_io_init()
+{
+	// Setup pins
+	for (int i = 0; i < NUM_BTNS; i++) {
+		pinMode(&expander, PIN_BTN[i], INPUT);
+		attachInterrupt(&expander, PIN_BTN[i]);
+	}
+}
+
+
+void
+btns_refresh()
+{
+	// Read in pins
+	tick_capture(btns_sampled);
+	uint8_t btn_states = 0;
+	for (int i = 0; i < NUM_BTNS; i++) {
+		btn_states |= (!digitalRead(&expander, PIN_BTN[i])) << i;
+	}
+	port_read(PORT_BTNS, btn_states);
+	
+	btns.set_btn_states(btn_states, tick);
+}
+
+
+
+/******************************************************************************
+ * Amplifier stuff                                                            *
+ ******************************************************************************/
+
+static const int AMP_WAIT_TIME = 10;
+
+// The volume is changed by emulating the knob's rotary encoder, one step is
+// this sequence of (pin B?, level) writes with pins A and B swapped for down.
+static const uint8_t AMP_WAVE[4][2] = {{0, HIGH}, {1, HIGH}, {0, LOW}, {1, LOW}};
+
+// The volume is unknown (-1) until the amp has been homed to its minimum
+int amp_volume = -1;
+
+// Steps waiting to be sent (positive is up) and the volume to head for once
+// they have been (-1 for none)
+int amp_steps = 0;
+int amp_target = -1;
+bool amp_homing = false;
+
+// The step being sent
+int amp_dir = 0;
+uint8_t amp_phase = 0;
+unsigned long amp_next_phase = 0;
+
+
+// Pick up the next step, returns false if there is nothing to send
+bool
+amp_start_step()
+{
+	if (amp_steps == 0) {
+		// Enough steps down to reach the minimum from anywhere
+		if (amp_homing) {
+			amp_homing = false;
+			amp_volume = 0;
+		}
+		
+		if (amp_target >= 0 && amp_volume >= 0) {
+			amp_steps = amp_target - amp_volume;
+			amp_target = -1;
+		}
+		
+		if (amp_steps == 0)
+			return false;
+	}
+	
+	amp_dir = (amp_steps > 0) ? 1 : -1;
+	amp_steps -= amp_dir;
+	
+	// The knob stops at either end
+	if (amp_volume >= 0)
+		amp_volume = constrain(amp_volume + amp_dir, 0, AMP_MAX_VOLUME);
 	
-	if (backdoor_state != new_state)
-		if (new_state)
-			(*backdoor_opened)();
-		else
-			(*backdoor_closed)();
+	return true;
+}
+
+
+void
+amp_refresh()
+{
+	if (!io_ready || (long)(tick.ms - amp_next_phase) < 0)
+		return;
 	
-	backdoor_state = new_state;
+	if (amp_phase == 0 && !amp_start_step())
+		return;
+	
+	uint8_t pin_a = (amp_dir > 0) ? PIN_AMP_A : PIN_AMP_B;
+	uint8_t pin_b = (amp_dir > 0) ? PIN_AMP_B : PIN_AMP_A;
+	digitalWrite(&expander, AMP_WAVE[amp_phase][0] ? pin_b : pin_a,
+	             AMP_WAVE[amp_phase][1]);
+	
+	amp_phase = (amp_phase + 1) % 4;
+	amp_next_phase = tick.ms + AMP_WAIT_TIME;
+}
+
+
+bool amp_is_busy() { return amp_phase != 0 || amp_steps != 0 || amp_target >= 0; }
+
+
+// Queue relative steps. They are ignored while homing, which relies on its
+// step count to know when the minimum is reached. No more than a full sweep
+// is ever queued as the knob stops at either end.
+void
+amp_add_steps(int steps)
+{
+	if (amp_homing)
+		return;
+	amp_steps = constrain(amp_steps + steps, -AMP_HOME_STEPS, AMP_HOME_STEPS);
+}
+
+
+void
+amp_inc_vol(int repeat)
+{
+	shet_called(CALL_AMP_INC, repeat);
+	if (repeat > 0)
+		amp_add_steps(min(repeat, AMP_HOME_STEPS));
+}
+
+
+void
+amp_dec_vol(int repeat)
+{
+	shet_called(CALL_AMP_DEC, repeat);
+	if (repeat > 0)
+		amp_add_steps(-min(repeat, AMP_HOME_STEPS));
+}
+
+
+// Step down far enough to be sure of reaching the minimum
+void
+amp_home()
+{
+	shet_called(CALL_AMP_HOME, 0);
+	amp_steps = -AMP_HOME_STEPS;
+	amp_homing = true;
+}
+
+
+// Head straight for a volume, homing first if it isn't known
+void
+amp_set_volume(int volume)
+{
+	shet_called(CALL_AMP_VOLUME, volume);
+	
+	amp_target = constrain(volume, 0, AMP_MAX_VOLUME);
+	
+	if (amp_homing)
+		return;
+	
+	if (amp_volume < 0) {
+		amp_steps = -AMP_HOME_STEPS;
+		amp_homing = true;
+	} else {
+		// Any queued relative steps are replaced
+		amp_steps = 0;
+	}
+}
+
+
+int amp_get_volume() { return amp_volume; }
+
+
+void
+amp_init()
+{
+	shetsource.AddAction(AMP_DEC_NAME, amp_dec_vol);
+	shetsource.AddAction(AMP_INC_NAME, amp_inc_vol);
+	shetsource.AddAction(AMP_HOME_NAME, amp_home);
+	shetsource.AddProperty(AMP_VOLUME_NAME, amp_set_volume, amp_get_volume);
+}
+
+
+void
+amp_io_init()
+{
+	digitalWrite(&expander, PIN_AMP_A, LOW);
+	pinMode(&expander, PIN_AMP_A, OUTPUT);
+	
+	digitalWrite(&expander, PIN_AMP_B, LOW);
+	pinMode(&expander, PIN_AMP_B, OUTPUT);
 }
 
 
 
 /******************************************************************************
- * Button Panel                                                               *
+ * Boot Sequencing                                                            *
  ******************************************************************************/
 
-ButtonManager btns = ButtonManager(LONG_PRESS,
-                                   NUM_MODES,
-                                   NUM_BTN_NORM,
-                                   BTN_NORM_MASKS,
-                                   NUM_BTN_MODE,
-                                   BTN_MODE_MASKS,
-                                   NUM_BTN_MOD,
-                                   BTN_MOD_MASKS);
+// Stages of the boot process in the order they complete
+enum BootStage {
+	BOOT_SHETSOURCE = 0,
+	BOOT_LIGHTS,
+	BOOT_RGBLED,
+	BOOT_WASHING,
+	BOOT_OVEN,
+	BOOT_PIR,
+	BOOT_BTNS,
+	BOOT_LIGHTSWITCH,
+	BOOT_BACKDOOR,
+	BOOT_AMP,
+	
+	// Deferred stages (run from the main loop in staged mode)
+	BOOT_IO,
+	BOOT_SERVO_KITCHEN,
+	BOOT_SERVO_LOUNGE,
+	
+	NUM_BOOT_STAGES
+};
 
-SHETSource::LocalEvent *evt_on_press;
-SHETSource::LocalEvent *evt_on_mode_change;
+// Time each stage completed in tenths of a millisecond since reset
+unsigned int boot_times[NUM_BOOT_STAGES];
 
-Colour btn_old_colour;
+// The next deferred stage to run
+int boot_stage = BOOT_IO;
 
 
 void
-btn_set_colour(int mode)
+boot_mark(int stage)
 {
-	set_rgbled_colour(MODE_COLOURS[mode&0x3][mode>>2][0],
-	                  MODE_COLOURS[mode&0x3][mode>>2][1],
-	                  MODE_COLOURS[mode&0x3][mode>>2][2],
-	                  RGBLED_FADE_FAST);
+	unsigned long t = micros() / 100ul;
+	boot_times[stage] = (t > 0x7FFF) ? 0x7FFF : t;
 }
 
 
-void
-btn_on_press(int mode, uint8_t modifiers, bool long_press, uint8_t buttons)
+// Getter for a stage's completion time
+int
+get_boot_time(int stage)
 {
-	int encoded = 0;
-	encoded = mode;
-	encoded = (encoded<<NUM_BTN_MOD) | modifiers;
-	encoded = (encoded<<1) | long_press;
-	encoded = (encoded<<NUM_BTN_NORM) | buttons;
-	(*evt_on_press)(encoded);
+	if (stage < 0 || stage >= NUM_BOOT_STAGES)
+		return -1;
+	return boot_times[stage];
 }
 
 
+bool
+boot_complete()
+{
+	return boot_stage == NUM_BOOT_STAGES;
+}
+
+
+// Configure the expander and everything attached to it
 void
-btn_on_mode_change(int mode)
+boot_io()
 {
-	btn_set_colour(mode);
-	(*evt_on_mode_change)(mode);
+	io_init();
+	btns_io_init();
+	lightswitch_io_init();
+	backdoor_io_init();
+	amp_io_init();
+	led_channels_io_init();
+	
+	io_ready = true;
 }
 
 
+// Run the next deferred stage. The servos are homed one at a time to avoid
+// browning out the supply.
 void
-btn_on_hold_start(bool starting)
+boot_refresh()
 {
-	if (starting) {
-		btn_old_colour.r = rgbled.new_col.r;
-		btn_old_colour.g = rgbled.new_col.g;
-		btn_old_colour.b = rgbled.new_col.b;
+	switch (boot_stage) {
+		case BOOT_IO:
+			boot_io();
+			break;
+		
+		case BOOT_SERVO_KITCHEN:
+			light_kitchen.init(tick);
+			break;
+		
+		case BOOT_SERVO_LOUNGE:
+			light_kitchen.refresh(tick);
+			if (light_kitchen.is_busy(tick))
+				return;
+			light_lounge.init(tick);
+			break;
+		
+		default:
+			return;
 	}
 	
-	// Start fading the LED off
-	set_rgbled_colour(0,0,0, LONG_PRESS);
+	boot_mark(boot_stage++);
 }
 
 
 void
-btn_on_hold_end(bool finished)
+boot_init()
 {
-	if (finished) {
-		rgbled.cur_col.r = 0;
-		rgbled.cur_col.g = 255;
-		rgbled.cur_col.b = 0;
+	shetsource.AddAction(BOOT_TIME_NAME, get_boot_time);
+	
+	if (!STAGED_INIT) {
+		// Do everything up-front
+		while (!boot_complete()) {
+			tick_capture(tick);
+			boot_refresh();
+		}
 	}
-	rgbled.set_colour(btn_old_colour, RGBLED_FADE_FAST);
 }
 
 
+
+/******************************************************************************
+ * Watchdog                                                                   *
+ ******************************************************************************/
+
+// The periodic tasks which check in with the watchdog
+enum Task {
+	TASK_SHET = 0,
+	TASK_RGBLED,
+	TASK_BTN_LOOP,
+	TASK_SLOW_LOOP,
+	
+	NUM_TASKS
+};
+
+
+#if WATCHDOG
+
+// Details of the last stall, kept in RAM which survives a reset
+struct StallRecord {
+	uint16_t magic;
+	uint8_t  task;
+	uint16_t duration; // ms the task had run, or gone without checking in
+	uint8_t  count;    // Watchdog resets since power-on
+};
+
+static const uint16_t STALL_MAGIC = 0x57D0;
+
+StallRecord stall_record __attribute__((section(".noinit")));
+
+// The reset cause, saved before anything else runs
+uint8_t reset_flags __attribute__((section(".noinit")));
+
+// The task running (NUM_TASKS when none) and when it started
+volatile uint8_t task_running = NUM_TASKS;
+volatile unsigned long task_started;
+
+// When each task last finished (0 if it hasn't run yet)
+unsigned long task_checkins[NUM_TASKS];
+
+// Smoothed time (us) of a pass of the main loop and when the last one started
+unsigned int watchdog_pass_time;
+unsigned long watchdog_last_pass;
+
+
+// Longest time (ms) a task may go without checking in. The loops run only
+// every few passes or ms (as configured) so that wait is added to their
+// timeouts, a long loop period can't trip the watchdog.
+unsigned long
+task_timeout(uint8_t task)
+{
+	unsigned long wait = 0;
+#if LOW_POWER_IDLE
+	if (task == TASK_BTN_LOOP)
+		wait = config.btn_loop_interval;
+	else if (task == TASK_SLOW_LOOP)
+		wait = config.slow_loop_interval;
+#else
+	if (task == TASK_BTN_LOOP)
+		wait = (unsigned long)config.btn_loop_period * watchdog_pass_time / 1000u;
+	else if (task == TASK_SLOW_LOOP)
+		wait = (unsigned long)config.slow_loop_period * watchdog_pass_time / 1000u;
+#endif
+	return TASK_TIMEOUTS[task] + wait;
+}
+
+
+// Stop the watchdog before it can reset us again while we start up
+void watchdog_early() __attribute__((naked, used, section(".init3")));
 void
-btn_set_mode(int mode)
+watchdog_early()
+{
+	reset_flags = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+
+// First timeout: record whatever stalled, the next timeout resets the MCU
+ISR(WDT_vect)
 {
-	btns.mode = mode;
-	btn_on_mode_change(mode);
+	unsigned long now = millis();
+	uint8_t task = task_running;
+	unsigned long duration = now - task_started;
+	
+	if (task == NUM_TASKS) {
+		// Nothing hung mid-task, blame the task most overdue
+		long worst = 0;
+		for (int i = 0; i < NUM_TASKS; i++) {
+			long overdue = (now - task_checkins[i]) - task_timeout(i);
+			if (task_checkins[i] != 0 && overdue > worst) {
+				worst = overdue;
+				task = i;
+				duration = now - task_checkins[i];
+			}
+		}
+	}
+	
+	stall_record.magic = STALL_MAGIC;
+	stall_record.task = task;
+	stall_record.duration = min(duration, 0xFFFFul);
 }
 
 
+// Getter for the last stall: 0 reset flags (MCUSR), 1 task (-1 for none or
+// unknown), 2 duration (ms, saturating), 3 watchdog resets since power-on
 int
-btn_get_mode()
+get_last_stall(int field)
 {
-	return btns.mode;
+	bool valid = stall_record.magic == STALL_MAGIC;
+	
+	switch (field) {
+		case 0: return reset_flags;
+		case 1: return (valid && stall_record.task < NUM_TASKS) ? stall_record.task : -1;
+		case 2: return valid ? min(stall_record.duration, 0x7FFFu) : 0;
+		case 3: return valid ? stall_record.count : 0;
+		default: return -1;
+	}
 }
 
+#endif
+
 
 void
-btns_init()
+task_begin(Task task)
 {
-	// Setup pins
-	for (int i = 0; i < NUM_BTNS; i++) {
-		pinMode(&expander, PIN_BTN[i], INPUT);
-		attachInterrupt(&expander, PIN_BTN[i]);
-	}
-	
-	// Setup SHET events
-	evt_on_press = shetsource.AddEvent(BTNS_ON_PRESS_NAME);
-	evt_on_mode_change = shetsource.AddEvent(BTNS_ON_MODE_CHANGE_NAME);
-	shetsource.AddProperty(BTNS_MODE, btn_set_mode, btn_get_mode);
+#if WATCHDOG
+	task_started = millis();
+	task_running = task;
+#endif
+}
+
+
+void
+task_end(Task task)
+{
+#if WATCHDOG
+	task_running = NUM_TASKS;
+	task_checkins[task] = millis();
+	if (task_checkins[task] == 0)
+		task_checkins[task] = 1;
+#endif
+}
+
+
+// Reset the watchdog only while every task which has started running keeps
+// checking in
+void
+watchdog_refresh()
+{
+#if WATCHDOG
+	// Moving average over about 16 passes, each pass capped at 65ms
+	unsigned long pass = min(tick.us - watchdog_last_pass, 0xFFFFul);
+	watchdog_last_pass = tick.us;
+	watchdog_pass_time += (pass >> 4) - (watchdog_pass_time >> 4);
 	
+	unsigned long now = millis();
+	for (int i = 0; i < NUM_TASKS; i++)
+		if (task_checkins[i] != 0 && now - task_checkins[i] > task_timeout(i))
+			return;
 	
-	// Bind callbacks
-	btns.on_mode_change = btn_on_mode_change;
-	btns.on_press       = btn_on_press;
-	btns.on_hold_start  = btn_on_hold_start;
-	btns.on_hold_end    = btn_on_hold_end;
+	wdt_reset();
 	
-	btn_set_colour(btns.mode);
+	// The interrupt clears WDIE when it fires, without it set again the next
+	// timeout would reset straight away without recording the stall
+	WDTCSR |= _BV(WDIE);
+#endif
 }
 
 
 void
-btns_refresh()
+watchdog_init()
 {
-	// Read in pins
-	uint8_t btn_states = 0;
-	for (int i = 0; i < NUM_BTNS; i++) {
-		btn_states |= (!digitalRead(&expander, PIN_BTN[i])) << i;
+#if WATCHDOG
+	// A stall record left by garbage at power-on isn't one
+	if (reset_flags & (_BV(PORF) | _BV(BORF)))
+		stall_record.magic = 0;
+	if (stall_record.magic != STALL_MAGIC) {
+		stall_record.task = NUM_TASKS;
+		stall_record.duration = 0;
+		stall_record.count = 0;
+	}
+	
+	// Count the resets themselves, the interrupt can fire without one
+	if (reset_flags & _BV(WDRF)) {
+		stall_record.magic = STALL_MAGIC;
+		stall_record.count++;
 	}
 	
-	btns.set_btn_states(btn_states);
+	shetsource.AddAction(LAST_STALL_NAME, get_last_stall);
+	
+	// Interrupt (to record the stall) then reset
+	wdt_enable(WDTO_4S);
+	WDTCSR |= _BV(WDIE);
+#endif
 }
 
 
 
 /******************************************************************************
- * Amplifier stuff                                                            *
+ * Low-Power Idle                                                             *
  ******************************************************************************/
 
-static const int AMP_WAIT_TIME = 10;
+#if LOW_POWER_IDLE
+
+// Set from the pin-change interrupts when something needs servicing
+volatile bool idle_woken = false;
+volatile bool idle_io_pending = false;
+volatile unsigned long idle_wake_time = 0;
+
+// Instrumentation
+unsigned long idle_asleep_time = 0;  // Time asleep (us) since the duty was read
+unsigned long idle_window_start = 0; // When the duty was last read (us)
+unsigned int idle_max_latency = 0;   // Worst pin-change wake latency (us)
+
 
 void
-amp_wave(uint8_t pin_a, uint8_t pin_b)
+idle_wake()
 {
-	digitalWrite(&expander, pin_a, HIGH);
-	delay(AMP_WAIT_TIME);
-	digitalWrite(&expander, pin_b, HIGH);
-	delay(AMP_WAIT_TIME);
-	digitalWrite(&expander, pin_a, LOW);
-	delay(AMP_WAIT_TIME);
-	digitalWrite(&expander, pin_b, LOW);
-	delay(AMP_WAIT_TIME);
+	if (!idle_woken) {
+		idle_wake_time = micros();
+		idle_woken = true;
+	}
 }
 
+// PIN_IO_INTERRUPT (PB4)
+ISR(PCINT0_vect) { idle_io_pending = true; idle_wake(); }
 
-void
-amp_inc_vol(int repeat)
+// PIN_SHETSOURCE_READ (PD7)
+ISR(PCINT2_vect) { shet_line_changed = true; idle_wake(); }
+
+
+// Getter for the permille of time spent awake since the last call
+int
+get_idle_duty()
+{
+	unsigned long now = micros();
+	unsigned long window = now - idle_window_start;
+	int duty = 1000;
+	if (window / 1000ul != 0)
+		duty = 1000 - (int)(idle_asleep_time / (window / 1000ul));
+	
+	idle_asleep_time = 0;
+	idle_window_start = now;
+	return duty;
+}
+
+
+// Getter for the worst wake-up latency since the last call
+int
+get_idle_latency()
 {
-	for (int i = 0; i < repeat; i++)
-		amp_wave(PIN_AMP_A, PIN_AMP_B);
+	int latency = idle_max_latency;
+	idle_max_latency = 0;
+	return latency;
 }
 
 
 void
-amp_dec_vol(int repeat)
+idle_init()
 {
-	for (int i = 0; i < repeat; i++)
-		amp_wave(PIN_AMP_B, PIN_AMP_A);
+	// Wake on SHET traffic and the expander's interrupt line. The interrupts
+	// are only enabled while asleep (see idle_until), awake the SHET line
+	// toggles on every bit of a message and the flags are polled instead.
+	PCMSK0 |= _BV(PCINT4);
+	PCMSK2 |= _BV(PCINT23);
+	
+	// Keep the timers running for millis() and the LED PWM
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	
+	shetsource.AddAction(IDLE_DUTY_NAME, get_idle_duty);
+	shetsource.AddAction(IDLE_LATENCY_NAME, get_idle_latency);
+	
+	idle_window_start = micros();
 }
 
 
+// Sleep until the deadline passes or a pin-change wakes us. The timer 0
+// overflow wakes the CPU every millisecond to check the deadline. A pin
+// change flagged while awake fires as soon as its interrupt is enabled, so
+// nothing is slept through.
 void
-amp_init()
+idle_until(unsigned long deadline)
 {
-	digitalWrite(&expander, PIN_AMP_A, LOW);
-	pinMode(&expander, PIN_AMP_A, OUTPUT);
+	unsigned long start = micros();
 	
-	digitalWrite(&expander, PIN_AMP_B, LOW);
-	pinMode(&expander, PIN_AMP_B, OUTPUT);
+	// Only a wake from this sleep counts
+	cli();
+	idle_woken = false;
+	sei();
 	
-	shetsource.AddAction(AMP_DEC_NAME, amp_dec_vol);
-	shetsource.AddAction(AMP_INC_NAME, amp_inc_vol);
+	while ((long)(deadline - millis()) > 0) {
+		cli();
+		if (idle_woken) {
+			sei();
+			break;
+		}
+		PCICR |= _BV(PCIE0) | _BV(PCIE2);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		PCICR &= ~(_BV(PCIE0) | _BV(PCIE2));
+	}
+	
+	unsigned long end = micros();
+	idle_asleep_time += end - start;
+	
+	if (idle_woken) {
+		cli();
+		unsigned long latency = end - idle_wake_time;
+		idle_woken = false;
+		sei();
+		
+		if (latency > idle_max_latency)
+			idle_max_latency = (latency > 0xFFFF) ? 0xFFFF : latency;
+	}
+}
+
+
+// Return whichever deadline comes first
+unsigned long
+earliest(unsigned long a, unsigned long b)
+{
+	return ((long)(a - b) < 0) ? a : b;
+}
+
+#endif
+
+
+
+/******************************************************************************
+ * Memory Usage                                                               *
+ ******************************************************************************/
+
+// Free RAM is painted with this at boot so the stack's deepest point can be
+// found later
+static const uint8_t STACK_PAINT = 0xC5;
+
+// Linker symbols: end of static RAM, start of the heap, top of the stack and
+// the end of the heap (0 until malloc() is first used)
+extern uint8_t _end;
+extern uint8_t __heap_start;
+extern uint8_t __stack;
+extern char *__brkval;
+
+// Least free space ever left between the heap and the stack (bytes)
+int stack_headroom = 0;
+
+
+// Paint the free RAM from _end to the top of the stack before the
+// constructors run. This is in .init5, after watchdog_early (.init3) has
+// stopped the watchdog and before anything is on the stack, and is written
+// in assembly so that nothing the compiler might keep on the stack is painted
+// over.
+void stack_paint() __attribute__((naked, used, section(".init5")));
+void
+stack_paint()
+{
+	__asm__ __volatile__ (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack + 1)\n"
+		"1:	st Z+, r24\n"
+		"	cpi r30, lo8(__stack + 1)\n"
+		"	cpc r31, r25\n"
+		"	brne 1b\n"
+		:
+		: "i" (STACK_PAINT)
+		: "r24", "r25", "r30", "r31", "memory");
+}
+
+
+uint8_t *
+heap_end()
+{
+	return __brkval ? (uint8_t *)__brkval : &__heap_start;
+}
+
+
+// Count the paint the stack has never reached
+void
+memory_refresh()
+{
+	uint8_t *p = heap_end();
+	while (p <= &__stack && *p == STACK_PAINT)
+		p++;
+	stack_headroom = p - heap_end();
+}
+
+
+// Getter for memory use (bytes): 0 free now, 1 least ever free (stack
+// high-water mark, as of the last check), 2 heap, 3 static data and bss
+int
+get_memory(int field)
+{
+	switch (field) {
+		case 0:  return (uint8_t *)SP - heap_end();
+		case 1:  return stack_headroom;
+		case 2:  return heap_end() - &__heap_start;
+		case 3:  return &_end - (uint8_t *)RAMSTART;
+		default: return -1;
+	}
+}
+
+
+// Static RAM taken by the main objects, fixed at build time (kept in flash).
+// size_report.sh lists every symbol, including the libraries' own buffers.
+static const unsigned int OBJECT_SIZES[] PROGMEM = {sizeof(pins) + sizeof(comms) + sizeof(shetsource),
+                                                    sizeof(config),
+                                                    sizeof(notifier),
+                                                    sizeof(analog),
+                                                    sizeof(capture),
+                                                    sizeof(servos),
+                                                    sizeof(light_kitchen) + sizeof(light_lounge),
+                                                    sizeof(occupancy),
+                                                    sizeof(rgbled),
+                                                    sizeof(led_channels),
+                                                    sizeof(washing),
+                                                    sizeof(btns),
+                                                    sizeof(expander)};
+
+// Getter for the size of an object: 0 SHETSource client, 1 config, 2 notifier,
+// 3 analog sampling, 4 waveform capture, 5 servo pulses, 6 lights, 7
+// occupancy, 8 RGB LED, 9 LED channels, 10 washing monitor, 11 buttons, 12
+// I/O expander
+int
+get_object_size(int n)
+{
+	if (n < 0 || n >= (int)(sizeof(OBJECT_SIZES) / sizeof(OBJECT_SIZES[0])))
+		return -1;
+	return pgm_read_word(&OBJECT_SIZES[n]);
+}
+
+
+void
+memory_init()
+{
+	shetsource.AddAction(MEMORY_NAME, get_memory);
+	shetsource.AddAction(OBJECT_SIZE_NAME, get_object_size);
 }
 
 
@@ -682,20 +2703,41 @@ amp_init()
  * Setup/Mainloop                                                             *
  ******************************************************************************/
 
+void
+config_apply()
+{
+	lights_configure();
+	btns.set_long_press(config.long_press);
+}
+
+
 void
 setup()
 {
-	shetsource_init();
-	io_init();
-	lights_init();
-	rgbled_init();
-	washing_init();
-	oven_init();
-	pir_init();
-	btns_init();
-	lightswitch_init();
-	backdoor_init();
-	amp_init();
+	shetsource_init();   boot_mark(BOOT_SHETSOURCE);
+	config_init();
+	shet_service_init();
+	event_stamps_init();
+	memory_init();
+	trace_init();
+	props_init();
+	analog_init();
+	lights_init();       boot_mark(BOOT_LIGHTS);
+	rgbled_init();       boot_mark(BOOT_RGBLED);
+	led_channels_init();
+	washing_init();      boot_mark(BOOT_WASHING);
+	oven_init();         boot_mark(BOOT_OVEN);
+	pir_init();          boot_mark(BOOT_PIR);
+	btns_init();         boot_mark(BOOT_BTNS);
+	lightswitch_init();  boot_mark(BOOT_LIGHTSWITCH);
+	backdoor_init();     boot_mark(BOOT_BACKDOOR);
+	amp_init();          boot_mark(BOOT_AMP);
+	analog_prime();
+	boot_init();
+	watchdog_init();
+#if LOW_POWER_IDLE
+	idle_init();
+#endif
 }
 
 
@@ -703,8 +2745,16 @@ setup()
 inline void
 fast_loop()
 {
-	shetsource.DoSHET();
+	task_begin(TASK_SHET);
+	shet_service();
+	task_end(TASK_SHET);
+	
+	task_begin(TASK_RGBLED);
 	rgbled_refresh();
+	task_end(TASK_RGBLED);
+	
+	led_channels_refresh();
+	amp_refresh();
 }
 
 
@@ -712,9 +2762,13 @@ fast_loop()
 inline void
 btn_loop()
 {
+	task_begin(TASK_BTN_LOOP);
+	analog_refresh();
 	lights_refresh();
 	btns_refresh();
 	lightswitch_refresh();
+	props_refresh();
+	task_end(TASK_BTN_LOOP);
 }
 
 
@@ -722,28 +2776,72 @@ btn_loop()
 inline void
 slow_loop()
 {
+	task_begin(TASK_SLOW_LOOP);
 	washing_refresh();
 	oven_refresh();
 	pir_refresh();
 	backdoor_refresh();
+	memory_refresh();
+	task_end(TASK_SLOW_LOOP);
 }
 
 
 void
 loop()
 {
+	tick_capture(tick);
+	
 	// Execute a section of the main loop constantly
 	fast_loop();
+	watchdog_refresh();
+	
+	// Finish booting before touching the expander or servos
+	if (!boot_complete()) {
+		boot_refresh();
+		return;
+	}
+	
+#if LOW_POWER_IDLE
+	static unsigned long next_slow_loop = 0;
+	static unsigned long next_btn_loop = 0;
+	unsigned long now = tick.ms;
+	
+	// Something changed on the expander, scan the buttons straight away
+	if (idle_io_pending) {
+		idle_io_pending = false;
+		next_btn_loop = now;
+	}
+	
+	if ((long)(now - next_slow_loop) >= 0) {
+		slow_loop();
+		next_slow_loop = now + config.slow_loop_interval;
+	}
+	
+	if ((long)(now - next_btn_loop) >= 0) {
+		btn_loop();
+		next_btn_loop = now + config.btn_loop_interval;
+	}
 	
+	// Sleep until the next piece of scheduled work is due
+	unsigned long deadline = earliest(next_slow_loop, next_btn_loop);
+	if (rgbled.is_busy())
+		deadline = earliest(deadline, rgbled.next_refresh());
+	if (led_channels.is_busy())
+		deadline = earliest(deadline, led_channels.next_refresh());
+	if (amp_is_busy())
+		deadline = earliest(deadline, amp_next_phase);
+	idle_until(deadline);
+#else
 	// Execute a section of the main loop only occasionally
 	static int counter = 0;
 	counter++;
-	if (counter % SLOW_LOOP_PERIOD == 0) {
+	if (counter % config.slow_loop_period == 0) {
 		slow_loop();
 	}
 	
 	// Execute a section of the main loop for button reading (pseudo debounce)
-	if (counter % BTN_LOOP_PERIOD == 0) {
+	if (counter % config.btn_loop_period == 0) {
 		btn_loop();
 	}
+#endif
 }
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Report the flash and RAM taken by a build of the sketch, then every object
+# in RAM (data and bss) and the largest in flash, smallest first. This covers
+# the buffers inside the libraries which get_object_size can't see.
+#
+# Usage: size_report.sh <sketch.elf> [mcu]
+#
+# The Arduino IDE leaves the ELF in its build directory (eg.
+# /tmp/build*.tmp/livingroom.cpp.elf, shown with verbose compilation on).
+
+ELF="$1"
+MCU="${2:-atmega328p}"
+
+if [ -z "$ELF" ] || [ ! -f "$ELF" ]; then
+	echo "usage: $0 <sketch.elf> [mcu]" >&2
+	exit 1
+fi
+
+echo "== Totals"
+avr-size -C --mcu="$MCU" "$ELF"
+
+echo "== RAM (data/bss) by symbol, bytes"
+avr-nm -t d --size-sort -S -C "$ELF" | awk '$3 ~ /^[bBdD]$/ { printf "%6d  %s\n", $2 + 0, substr($0, index($0, $4)) }'
+
+echo "== Flash (code/rodata) by symbol, largest 30, bytes"
+avr-nm -t d --size-sort -S -C "$ELF" | awk '$3 ~ /^[tTrR]$/ { printf "%6d  %s\n", $2 + 0, substr($0, index($0, $4)) }' | tail -n 30
@@ -0,0 +1,294 @@
+/* Host test harness for ButtonManager.
+ *
+ * Drives the state machine from a virtual clock with every short sequence of
+ * button states (exhaustive), with long random sequences (fuzz) and times it
+ * (benchmark). The living room's 8-bit panel is tested exhaustively, it and a
+ * 14-input panel (in 16 and 32-bit states) are fuzzed and timed. Build and
+ * run with "make" in this directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <WProgram.h>
+#include "Buttons.h"
+
+
+unsigned long virtual_ms = 0;
+
+
+/******************************************************************************
+ * Panels                                                                     *
+ ******************************************************************************/
+
+static const unsigned long LONG_PRESS    = 750;
+
+// The inputs of a panel are bits shift to shift + num_inputs - 1 of its state
+template <typename State>
+struct Layout {
+	const char  *name;
+	uint8_t     num_modes;
+	int         num_inputs;
+	int         shift;
+	uint8_t     num_btn_norm;
+	const State *btn_norm_masks;
+	uint8_t     num_btn_mode;
+	const State *btn_mode_masks;
+	uint8_t     num_btn_mod;
+	const State *btn_mod_masks;
+};
+
+
+// The living room's panel (as in livingroom.cpp)
+static const uint8_t BTN_NORM_MASKS[]    = {0x01, 0x02, 0x04, 0x08, 0x10};
+static const uint8_t BTN_MODE_MASKS[]    = {0x20, 0x80};
+static const uint8_t BTN_MOD_MASKS[]     = {0x40};
+
+static const Layout<uint8_t> LIVINGROOM  = {"8-bit", 5, 8, 0,
+                                            5, BTN_NORM_MASKS,
+                                            2, BTN_MODE_MASKS,
+                                            1, BTN_MOD_MASKS};
+
+// A 14-input panel: ten normal buttons, two mode buttons and two modifiers
+static const uint16_t WIDE_NORM_MASKS[]  = {0x0001, 0x0002, 0x0004, 0x0008, 0x0010,
+                                            0x0020, 0x0040, 0x0080, 0x0100, 0x0200};
+static const uint16_t WIDE_MODE_MASKS[]  = {0x0400, 0x0800};
+static const uint16_t WIDE_MOD_MASKS[]   = {0x1000, 0x2000};
+
+static const Layout<uint16_t> WIDE       = {"16-bit", 10, 14, 0,
+                                            10, WIDE_NORM_MASKS,
+                                            2,  WIDE_MODE_MASKS,
+                                            2,  WIDE_MOD_MASKS};
+
+// The same 14 inputs at the top of a 32-bit state
+static const uint32_t HIGH_NORM_MASKS[]  = {0x00040000ul, 0x00080000ul, 0x00100000ul,
+                                            0x00200000ul, 0x00400000ul, 0x00800000ul,
+                                            0x01000000ul, 0x02000000ul, 0x04000000ul,
+                                            0x08000000ul};
+static const uint32_t HIGH_MODE_MASKS[]  = {0x10000000ul, 0x20000000ul};
+static const uint32_t HIGH_MOD_MASKS[]   = {0x40000000ul, 0x80000000ul};
+
+static const Layout<uint32_t> HIGH       = {"32-bit", 10, 14, 18,
+                                            10, HIGH_NORM_MASKS,
+                                            2,  HIGH_MODE_MASKS,
+                                            2,  HIGH_MOD_MASKS};
+
+
+/******************************************************************************
+ * Checking                                                                   *
+ ******************************************************************************/
+
+static int events;       // Events fired in the current press
+static bool hold_active; // Hold feedback is being shown
+static unsigned long failures;
+
+
+template <typename State>
+static void on_press(int mode, State modifiers, bool long_press, State buttons) { events++; }
+static void on_mode_change(int mode) { events++; }
+static void on_hold_start(bool starting) { hold_active = true; }
+static void on_hold_end(bool finished) { hold_active = false; }
+
+
+template <typename State>
+class Panel {
+	public:
+		ButtonManager<State> btns;
+		State state;
+		
+		Panel(const Layout<State> &layout)
+			: btns(LONG_PRESS,
+			       layout.num_modes,
+			       layout.num_btn_norm, layout.btn_norm_masks,
+			       layout.num_btn_mode, layout.btn_mode_masks,
+			       layout.num_btn_mod, layout.btn_mod_masks)
+			, state(0)
+		{
+			btns.on_press = on_press<State>;
+			btns.on_mode_change = on_mode_change;
+			btns.on_hold_start = on_hold_start;
+			btns.on_hold_end = on_hold_end;
+			events = 0;
+			hold_active = false;
+		}
+		
+		// Apply a new button state, returns false (after reporting) if the
+		// state machine misbehaved
+		bool step(State new_state, unsigned long delta)
+		{
+			virtual_ms += delta;
+			btns.set_btn_states(new_state, virtual_ms);
+			
+			const char *error = NULL;
+			if (!btns.check_invariants())
+				error = "invariant broken";
+			else if (events > 1)
+				error = "more than one event for a press";
+			else if (new_state == 0 && state != 0 && events != 1)
+				error = "press released without an event";
+			else if (new_state == 0 && hold_active)
+				error = "hold feedback left on after release";
+			
+			if (new_state == 0)
+				events = 0;
+			state = new_state;
+			
+			if (error) {
+				failures++;
+				if (failures <= 10)
+					fprintf(stderr, "FAIL at %lu ms: %s (state 0x%08lx mode %d)\n",
+					        virtual_ms, error, (unsigned long)new_state, btns.mode);
+				return false;
+			}
+			return true;
+		}
+};
+
+
+/******************************************************************************
+ * Drivers                                                                    *
+ ******************************************************************************/
+
+// Every sequence of up to three states, each followed by a release. Steps are
+// either short or long enough to make a long press.
+static unsigned long
+run_exhaustive()
+{
+	static const unsigned long DELTAS[] = {20, LONG_PRESS + 1};
+	unsigned long steps = 0;
+	
+	for (int len = 1; len <= 3; len++) {
+		unsigned long num_seqs = 1ul << (8 * len);
+		int num_timings = 1 << len;
+		
+		for (unsigned long seq = 0; seq < num_seqs; seq++) {
+			for (int timing = 0; timing < num_timings; timing++) {
+				// Long steps are only tried on the shorter sequences
+				if (len == 3 && timing != 0)
+					break;
+				
+				Panel<uint8_t> panel(LIVINGROOM);
+				bool ok = true;
+				for (int i = 0; i < len && ok; i++)
+					ok = panel.step((seq >> (8 * i)) & 0xFF, DELTAS[(timing >> i) & 1]);
+				if (ok)
+					panel.step(0, 20);
+				steps += len + 1;
+			}
+		}
+	}
+	
+	return steps;
+}
+
+
+static uint32_t rng_state;
+
+static uint32_t
+rng()
+{
+	// xorshift32
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+
+// A plausible next state: usually one button changes, sometimes all are
+// released or the state jumps
+template <typename State>
+static State
+random_state(const Layout<State> &layout, State state)
+{
+	State inputs = (State)(((1ul << layout.num_inputs) - 1) << layout.shift);
+	uint32_t r = rng();
+	switch (r & 0x7) {
+		case 0:  return 0;
+		case 1:  return (State)((r >> 8) << layout.shift) & inputs;
+		default: return state ^ ((State)1 << (layout.shift + (r >> 8) % layout.num_inputs));
+	}
+}
+
+
+static unsigned long
+random_delta()
+{
+	// Mostly poll-rate steps with the odd long gap
+	uint32_t r = rng();
+	return (r & 0xF) ? (r >> 8) % 100 : (r >> 8) % (3 * LONG_PRESS);
+}
+
+
+template <typename State>
+static void
+run_fuzz(const Layout<State> &layout, uint32_t seed, unsigned long num_steps)
+{
+	rng_state = seed ? seed : 1;
+	unsigned long before = failures;
+	
+	Panel<State> panel(layout);
+	for (unsigned long i = 0; i < num_steps; i++)
+		panel.step(random_state(layout, panel.state), random_delta());
+	
+	printf("fuzz %s (seed %lu): %lu updates, %lu failures\n",
+	       layout.name, (unsigned long)seed, num_steps, failures - before);
+}
+
+
+// Time set_btn_states alone over a precomputed random trace
+template <typename State>
+static void
+run_benchmark(const Layout<State> &layout, unsigned long num_steps)
+{
+	static const int TRACE_LEN = 4096;
+	static State trace[TRACE_LEN];
+	static unsigned long deltas[TRACE_LEN];
+	
+	rng_state = 12345;
+	State state = 0;
+	for (int i = 0; i < TRACE_LEN; i++) {
+		trace[i] = state = random_state(layout, state);
+		deltas[i] = random_delta();
+	}
+	
+	Panel<State> panel(layout);
+	panel.btns.on_press = NULL;
+	panel.btns.on_mode_change = NULL;
+	panel.btns.on_hold_start = NULL;
+	panel.btns.on_hold_end = NULL;
+	
+	clock_t start = clock();
+	unsigned long now = 0;
+	for (unsigned long i = 0; i < num_steps; i++) {
+		now += deltas[i % TRACE_LEN];
+		panel.btns.set_btn_states(trace[i % TRACE_LEN], now);
+	}
+	clock_t end = clock();
+	
+	double secs = (double)(end - start) / CLOCKS_PER_SEC;
+	printf("benchmark %s: %lu updates in %.3f s, %.1f ns/update, mode %d\n",
+	       layout.name, num_steps, secs, secs * 1e9 / num_steps, panel.btns.mode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t seed = argc > 1 ? strtoul(argv[1], NULL, 0) : (uint32_t)time(NULL);
+	unsigned long fuzz_steps = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000000ul;
+	
+	unsigned long steps = run_exhaustive();
+	printf("exhaustive 8-bit: %lu updates, %lu failures\n", steps, failures);
+	
+	run_fuzz(LIVINGROOM, seed, fuzz_steps);
+	run_fuzz(WIDE, seed, fuzz_steps);
+	run_fuzz(HIGH, seed, fuzz_steps);
+	
+	run_benchmark(LIVINGROOM, 10000000ul);
+	run_benchmark(WIDE, 10000000ul);
+	run_benchmark(HIGH, 10000000ul);
+	
+	return failures ? 1 : 0;
+}
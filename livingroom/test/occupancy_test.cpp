@@ -0,0 +1,69 @@
+/* Host test for Occupancy, driven with explicit times. Build and run with
+ * "make" in this directory.
+ */
+
+#include <stdio.h>
+
+#include <WProgram.h>
+#include "Occupancy.h"
+
+
+unsigned long virtual_ms = 0;
+
+static const unsigned long WINDOW  = 60000;
+static const unsigned long TIMEOUT = 300000;
+
+static int failures = 0;
+
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+}
+
+
+// Feed the sensor state every 200ms (as the slow loop does) from start to end
+static void
+hold(Occupancy &occupancy, bool state, unsigned long start, unsigned long end)
+{
+	for (unsigned long t = start; t < end; t += 200)
+		occupancy.update(state, t);
+}
+
+
+int
+main()
+{
+	// Continuous motion holds the sensor high, the room stays occupied
+	{
+		Occupancy occupancy(WINDOW, TIMEOUT);
+		hold(occupancy, false, 0, 1000);
+		hold(occupancy, true, 1000, 400000);
+		check(occupancy.is_occupied(), "vacant while the sensor is held high");
+		check(occupancy.get_motion_level() == 0,
+		      "a held trigger counted again after leaving the window");
+		
+		// The timeout runs from when the sensor was last high
+		hold(occupancy, false, 400000, 400000 + TIMEOUT);
+		check(occupancy.is_occupied(), "vacant before the timeout after motion");
+		hold(occupancy, false, 400000 + TIMEOUT, 400000 + TIMEOUT + 1000);
+		check(!occupancy.is_occupied(), "occupied after the timeout");
+	}
+	
+	// Each rising edge is one trigger however long it is held
+	{
+		Occupancy occupancy(WINDOW, TIMEOUT);
+		for (int i = 0; i < 5; i++) {
+			hold(occupancy, true,  i * 4000, i * 4000 + 2000);
+			hold(occupancy, false, i * 4000 + 2000, i * 4000 + 4000);
+		}
+		check(occupancy.get_motion_level() == 5, "triggers not counted once per edge");
+	}
+	
+	printf("occupancy: %d failures\n", failures);
+	return failures ? 1 : 0;
+}
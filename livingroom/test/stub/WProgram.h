@@ -0,0 +1,21 @@
+#ifndef WPROGRAM_H
+#define WPROGRAM_H
+
+/* Just enough of the Arduino core to build the libraries on the host. The
+ * clock is virtual and only moves when a test sets it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern unsigned long virtual_ms;
+
+inline unsigned long millis() { return virtual_ms; }
+inline unsigned long micros() { return virtual_ms * 1000ul; }
+
+// As wiring.h defines them
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define abs(x) ((x)>0?(x):-(x))
+
+#endif
@@ -0,0 +1,344 @@
+/* Host decoder and replay for traces captured with trace_start/trace_read.
+ *
+ * A trace file holds the words read back with trace_read, three per record
+ * (time, kind, value), separated by whitespace with '#' starting a comment.
+ *
+ *   trace_replay -d FILE  Lists the records with times from the trace start
+ *   trace_replay FILE     Feeds the records through the input libraries on
+ *                         the sketch's loop periods and prints the events the
+ *                         node would have raised, one "time event value" line
+ *                         each
+ *
+ * "make" replays each trace in traces/ and compares it against its .golden.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <WProgram.h>
+#include "Buttons.h"
+#include "Occupancy.h"
+#include "Trace.h"
+#include "Washing.h"
+
+
+unsigned long virtual_ms = 0;
+
+
+/******************************************************************************
+ * Node (as in livingroom.cpp)                                                *
+ ******************************************************************************/
+
+static const int APIN_WASHING            = 0;
+static const int APIN_OVEN               = 1;
+static const int APIN_PIR                = 2;
+static const int NUM_APINS               = 6;
+
+enum TracePort {
+	PORT_BTNS = 0,
+	PORT_LIGHTSWITCH,
+	PORT_BACKDOOR,
+	NUM_TRACE_PORTS
+};
+
+static const int CALL_BTN_MODE           = 5;
+
+static const char *CALL_NAMES[]          = {"light_kitchen", "light_lounge",
+                                            "light_toggle", "rgbled_instant",
+                                            "rgbled_fast", "btn_mode",
+                                            "amp_inc", "amp_dec", "rgbled_rg",
+                                            "rgbled_cmd", "rgbled_palette",
+                                            "rgbled_alert", "led_channel",
+                                            "analog_watch", "capture_start",
+                                            "amp_volume", "amp_home"};
+static const int NUM_CALLS               = 17;
+
+static const char *PORT_NAMES[]          = {"btns", "lightswitch", "backdoor"};
+
+static const unsigned long BTN_LOOP_PERIOD  = 100;
+static const unsigned long SLOW_LOOP_PERIOD = 1000;
+
+static const int OVEN_STATE_THRESHOLD    = 512;
+
+static const int PIR_THRESHOLD           = 712;
+static const unsigned long PIR_WINDOW    = 60000;
+static const unsigned long OCCUPANCY_TIMEOUT = 300000;
+
+static const int WASHING_STATE_THRESHOLD = 512;
+static const unsigned long WASHING_MIN   = 5;
+static const unsigned long WASHING_GAP   = 180000;
+static const int WASHING_WASH_LEVEL      = 128;
+static const int WASHING_SPIN_DEVIATION  = 64;
+
+static const unsigned long LONG_PRESS    = 750;
+static const uint8_t NUM_MODES           = 5;
+
+static const uint8_t NUM_BTN_NORM        = 5;
+static const uint8_t BTN_NORM_MASKS[]    = {0x01, 0x02, 0x04, 0x08, 0x10};
+
+static const uint8_t NUM_BTN_MODE        = 2;
+static const uint8_t BTN_MODE_MASKS[]    = {0x20, 0x80};
+
+static const uint8_t NUM_BTN_MOD         = 1;
+static const uint8_t BTN_MOD_MASKS[]     = {0x40};
+
+
+
+/******************************************************************************
+ * Decoding                                                                   *
+ ******************************************************************************/
+
+struct Record {
+	unsigned long time; // ms since the trace started
+	uint8_t  kind;
+	uint16_t value;
+};
+
+static const int MAX_RECORDS = 4096;
+
+static Record records[MAX_RECORDS];
+static int num_records = 0;
+
+
+// Read the next word of the trace, returns false at the end
+static bool
+read_word(FILE *f, long &word)
+{
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c == '#') {
+			while ((c = fgetc(f)) != EOF && c != '\n')
+				;
+		} else if (c > ' ') {
+			ungetc(c, f);
+			return fscanf(f, "%li", &word) == 1;
+		}
+	}
+	return false;
+}
+
+
+// Read a trace, gap records are folded into the time of the record after
+static bool
+load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	
+	unsigned long now = 0;
+	long time, kind, value;
+	while (read_word(f, time) && read_word(f, kind) && read_word(f, value)) {
+		// trace_read returns 16-bit ints, so large times come back negative
+		now += time & 0xFFFF;
+		if ((kind & 0xC0) == TRACE_GAP) {
+			now += (unsigned long)(value & 0xFFFF) << 16;
+			continue;
+		}
+		
+		if (num_records == MAX_RECORDS) {
+			fprintf(stderr, "%s: more than %d records\n", path, MAX_RECORDS);
+			break;
+		}
+		Record &r = records[num_records++];
+		r.time  = now;
+		r.kind  = kind & 0xFF;
+		r.value = value & 0xFFFF;
+	}
+	
+	fclose(f);
+	return true;
+}
+
+
+static void
+decode()
+{
+	for (int i = 0; i < num_records; i++) {
+		const Record &r = records[i];
+		int id = r.kind & 0x3F;
+		switch (r.kind & 0xC0) {
+			case TRACE_ANALOG:
+				printf("%8lu analog %d %u\n", r.time, id, r.value);
+				break;
+			
+			case TRACE_PORT:
+				printf("%8lu port   %s 0x%02X\n", r.time,
+				       id < NUM_TRACE_PORTS ? PORT_NAMES[id] : "?", r.value);
+				break;
+			
+			default:
+				printf("%8lu call   %s %d\n", r.time,
+				       id < NUM_CALLS ? CALL_NAMES[id] : "?", (int16_t)r.value);
+				break;
+		}
+	}
+}
+
+
+
+/******************************************************************************
+ * Replay                                                                     *
+ ******************************************************************************/
+
+// Inputs as last recorded, -1 until their first record
+static int analog[NUM_APINS];
+static int port[NUM_TRACE_PORTS];
+
+
+static void
+event(const char *name, long value)
+{
+	printf("%8lu %s %ld\n", virtual_ms, name, value);
+}
+
+
+static void
+on_press(int mode, uint8_t modifiers, bool long_press, uint8_t buttons)
+{
+	int encoded = 0;
+	encoded = mode;
+	encoded = (encoded<<NUM_BTN_MOD) | modifiers;
+	encoded = (encoded<<1) | long_press;
+	encoded = (encoded<<NUM_BTN_NORM) | buttons;
+	event("btn_pressed", encoded);
+}
+
+static void on_mode_change(int mode) { event("btn_mode_changed", mode); }
+static void on_hold_start(bool starting) { }
+static void on_hold_end(bool finished) { }
+
+
+static void
+replay()
+{
+	ButtonManager<uint8_t> btns(LONG_PRESS,
+	                            NUM_MODES,
+	                            NUM_BTN_NORM, BTN_NORM_MASKS,
+	                            NUM_BTN_MODE, BTN_MODE_MASKS,
+	                            NUM_BTN_MOD,  BTN_MOD_MASKS);
+	btns.on_press       = on_press;
+	btns.on_mode_change = on_mode_change;
+	btns.on_hold_start  = on_hold_start;
+	btns.on_hold_end    = on_hold_end;
+	
+	Occupancy occupancy(PIR_WINDOW, OCCUPANCY_TIMEOUT);
+	
+	WashingMonitor washing(WASHING_STATE_THRESHOLD,
+	                       WASHING_GAP,
+	                       WASHING_MIN * 1000ul);
+	washing.wash_level = WASHING_WASH_LEVEL;
+	washing.spin_deviation = WASHING_SPIN_DEVIATION;
+	
+	// Edge-triggered inputs take their first record as their starting state,
+	// a trace starts part way through the node's run
+	int lightswitch_state = -1;
+	int backdoor_state = -1;
+	int oven_state = -1;
+	
+	for (int i = 0; i < NUM_APINS; i++)
+		analog[i] = -1;
+	for (int i = 0; i < NUM_TRACE_PORTS; i++)
+		port[i] = -1;
+	
+	// Run on past the last record so pending timeouts are seen
+	unsigned long end = num_records ? records[num_records - 1].time : 0;
+	end += OCCUPANCY_TIMEOUT + SLOW_LOOP_PERIOD;
+	
+	int next = 0;
+	for (virtual_ms = 0; virtual_ms <= end; virtual_ms++) {
+		for (; next < num_records && records[next].time == virtual_ms; next++) {
+			const Record &r = records[next];
+			int id = r.kind & 0x3F;
+			switch (r.kind & 0xC0) {
+				case TRACE_ANALOG:
+					if (id < NUM_APINS)
+						analog[id] = r.value;
+					break;
+				
+				case TRACE_PORT:
+					if (id < NUM_TRACE_PORTS)
+						port[id] = r.value;
+					break;
+				
+				default:
+					// Only mode changes reach the modelled inputs
+					if (id == CALL_BTN_MODE && btns.set_mode((int16_t)r.value))
+						on_mode_change((int16_t)r.value);
+					break;
+			}
+		}
+		
+		if (virtual_ms % BTN_LOOP_PERIOD == 0) {
+			if (port[PORT_BTNS] >= 0)
+				btns.set_btn_states(port[PORT_BTNS], virtual_ms);
+			
+			if (port[PORT_LIGHTSWITCH] >= 0) {
+				if (lightswitch_state >= 0
+				    && lightswitch_state != port[PORT_LIGHTSWITCH]
+				    && port[PORT_LIGHTSWITCH] == true)
+					event("btn_lightswitch", 0);
+				lightswitch_state = port[PORT_LIGHTSWITCH];
+			}
+		}
+		
+		if (virtual_ms % SLOW_LOOP_PERIOD == 0) {
+			if (analog[APIN_WASHING] >= 0) {
+				switch (washing.update(analog[APIN_WASHING], virtual_ms)) {
+					case WashingMonitor::EVENT_STARTED:
+						event("washing_started", 0);
+						break;
+					
+					case WashingMonitor::EVENT_FINISHED:
+						event("washing_finished", washing.get_cycle(0).duration);
+						break;
+					
+					default:
+						break;
+				}
+			}
+			
+			if (analog[APIN_OVEN] >= 0) {
+				int new_state = analog[APIN_OVEN] > OVEN_STATE_THRESHOLD;
+				if (oven_state >= 0 && oven_state != new_state)
+					event(new_state ? "on_oven_on" : "on_oven_off", 0);
+				oven_state = new_state;
+			}
+			
+			if (analog[APIN_PIR] >= 0) {
+				if (occupancy.update(analog[APIN_PIR] < PIR_THRESHOLD, virtual_ms))
+					event("occupancy_changed", occupancy.is_occupied());
+			}
+			
+			if (port[PORT_BACKDOOR] >= 0) {
+				if (backdoor_state >= 0 && backdoor_state != port[PORT_BACKDOOR])
+					event(port[PORT_BACKDOOR] ? "backdoor_opened" : "backdoor_closed", 0);
+				backdoor_state = port[PORT_BACKDOOR];
+			}
+		}
+	}
+}
+
+
+
+int
+main(int argc, char *argv[])
+{
+	bool decode_only = argc == 3 && argv[1][0] == '-' && argv[1][1] == 'd';
+	if (argc != 2 && !decode_only) {
+		fprintf(stderr, "usage: %s [-d] FILE\n", argv[0]);
+		return 2;
+	}
+	
+	if (!load(argv[argc - 1]))
+		return 1;
+	
+	if (decode_only)
+		decode();
+	else
+		replay();
+	
+	return 0;
+}